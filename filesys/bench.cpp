@@ -0,0 +1,466 @@
+// Microbenchmarks of the file system stack. Run it with
+//    ./BENCH [threads] [passes] [blocks] [blocksize] [output.json]
+// Every case prints ops/sec and the p50 and p99 latency of one op:
+//    sdisk.*    raw block reads and writes under Filesys
+//    fs.*       create, append, read and delete over several file counts
+//               and sizes, inside one batch so fssynch is timed on its own
+//    fs.random  random blocks of one long file, so checkblock walks chains,
+//               then the same with the file pinned, then the whole file
+//               through mapfile
+//    shell.copy whole-file copies through Shell
+//    fixed      the same block reads and writes through Fixedfs<512>'s
+//               runtime and compile-time paths
+//    readers    threads reading their own files at once
+//    stream     one large file through buffered and direct I/O
+// The last argument writes every result as JSON, so two builds can be
+// compared case by case.
+
+#include "sdisk.h"
+#include "filesys.h"
+#include "fixedfs.h"
+#include "shell.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+struct Result
+{
+   string name;
+   long long ops;
+   double seconds;
+   vector<long long> latencies; // nanoseconds per op
+   string extra;                // further figures, "name value" pairs
+};
+
+static vector<Result> results;
+
+static double percentile(const vector<long long>& sorted, int p)
+{
+   if(sorted.empty())
+   {
+      return 0;
+   }
+   return sorted[(sorted.size() - 1) * p / 100] / 1000.0;
+}
+
+static void report(Result r)
+{
+   sort(r.latencies.begin(), r.latencies.end());
+   printf("%-34s %8lld %11.0f %9.2f %9.2f  %s\n", r.name.c_str(), r.ops, r.ops / r.seconds,
+          percentile(r.latencies, 50), percentile(r.latencies, 99), r.extra.c_str());
+   fflush(stdout);
+   results.push_back(r);
+}
+
+template<class Op>
+static Result measure(string name, int ops, Op op)
+{
+   //times each op(i) for i below ops
+   Result r;
+   r.name = name;
+   r.ops = ops;
+   r.latencies.reserve(ops);
+   long long start = Histogram::now();
+   for(int i = 0; i < ops; i++)
+   {
+      long long before = Histogram::now();
+      op(i);
+      r.latencies.push_back(Histogram::now() - before);
+   }
+   r.seconds = (Histogram::now() - start) / 1e9;
+   return r;
+}
+
+static double residentmb()
+{
+   //this process's resident set, from /proc
+   long pages = 0;
+   long resident = 0;
+   FILE* statm = fopen("/proc/self/statm", "r");
+   if(statm != NULL)
+   {
+      if(fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+      {
+         resident = 0;
+      }
+      fclose(statm);
+   }
+   return (double)resident * sysconf(_SC_PAGESIZE) / (1 << 20);
+}
+
+static double cachedmb(const char* name, bool drop)
+{
+   //bytes of the image in the host page cache; drop empties it first
+   int fd = open(name, O_RDONLY);
+   if(fd < 0)
+   {
+      return 0;
+   }
+   off_t size = lseek(fd, 0, SEEK_END);
+   if(drop)
+   {
+      fdatasync(fd);
+      posix_fadvise(fd, 0, size, POSIX_FADV_DONTNEED);
+   }
+   long pagesize = sysconf(_SC_PAGESIZE);
+   vector<unsigned char> resident((size + pagesize - 1) / pagesize);
+   long cached = 0;
+   void* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+   if(map != MAP_FAILED)
+   {
+      if(mincore(map, size, &resident[0]) == 0)
+      {
+         for(int i = 0; i < resident.size(); i++)
+         {
+            cached += resident[i] & 1;
+         }
+      }
+      munmap(map, size);
+   }
+   close(fd);
+   return (double)cached * pagesize / (1 << 20);
+}
+
+static void stream(bool direct, int passes)
+{
+   const int blocksize = 4096;
+   const int numberofblocks = 16384;
+   const int fileblocks = 12288;
+   remove("benchstream");
+   Filesys fsys("benchstream", numberofblocks, blocksize);
+   if(direct && fsys.setdirect(true) == 0)
+   {
+      return;
+   }
+   fsys.newfile("stream");
+   cachedmb("benchstream", true);
+   string data(64 * blocksize, 's');
+   vector<string_view> run = blockviews(data, blocksize);
+   string mode = direct ? " direct" : " buffered";
+   double mb = (double)fileblocks * blocksize / (1 << 20);
+   fsys.startbatch();
+   Result r = measure("stream.write" + mode, fileblocks / run.size(), [&](int)
+   {
+      fsys.addblocks("stream", run);
+   });
+   fsys.endbatch();
+   r.extra = "MB/s " + to_string((int)(mb / r.seconds));
+   report(r);
+   vector<string> buffers;
+   int block = 0;
+   r = measure("stream.read" + mode, passes * fileblocks / run.size(), [&](int)
+   {
+      if(block <= 0)
+      {
+         block = fsys.getfirstblock("stream");
+      }
+      block = fsys.readblocks("stream", block, run.size(), buffers);
+   });
+   char extra[128];
+   snprintf(extra, sizeof(extra), "MB/s %.0f, RSS %.1f MB, cached %.1f MB",
+            mb * passes / r.seconds, residentmb(), cachedmb("benchstream", false));
+   r.extra = extra;
+   report(r);
+}
+
+static void rawdisk(int numberofblocks, int blocksize)
+{
+   remove("benchraw");
+   Sdisk disk("benchraw", numberofblocks, blocksize);
+   mt19937 random(1);
+   int ops = min(numberofblocks, 20000);
+   string buffer(blocksize, 'r');
+   report(measure("sdisk.putblock", ops, [&](int i)
+   {
+      disk.putblock(i % numberofblocks, buffer);
+   }));
+   vector<char> data(blocksize);
+   report(measure("sdisk.getblock random", ops, [&](int)
+   {
+      disk.getblock(random() % numberofblocks, data.data());
+   }));
+   vector<int> numbers;
+   vector<string> buffers;
+   report(measure("sdisk.getblocks 64", ops / 64, [&](int i)
+   {
+      numbers.clear();
+      int first = (i * 64) % (numberofblocks - 64);
+      for(int j = 0; j < 64; j++)
+      {
+         numbers.push_back(first + j);
+      }
+      disk.getblocks(numbers, buffers);
+   }));
+   remove("benchraw");
+}
+
+static void files(int numberofblocks, int blocksize)
+{
+   int rootsize = blocksize / 12;
+   int counts[] = {1, rootsize - 2};
+   int sizes[] = {1, 16, 256};
+   for(int c = 0; c < 2; c++)
+   {
+      for(int z = 0; z < 3; z++)
+      {
+         int count = counts[c];
+         int size = sizes[z];
+         if(count < 1 || (long long)count * size > numberofblocks * 4 / 5)
+         {
+            continue;
+         }
+         string shape = " files=" + to_string(count) + " size=" + to_string(size);
+         remove("benchfs");
+         Filesys fsys("benchfs", numberofblocks, blocksize);
+         string buffer(blocksize, 'f');
+         fsys.startbatch(); //metadata is written once, at the end
+         report(measure("fs.newfile" + shape, count, [&](int i)
+         {
+            fsys.newfile("f" + to_string(i));
+         }));
+         report(measure("fs.addblock" + shape, count * size, [&](int i)
+         {
+            fsys.addblock("f" + to_string(i % count), buffer);
+         }));
+         vector<int> next(count, 0);
+         vector<char> data(blocksize);
+         report(measure("fs.readblock" + shape, count * size, [&](int i)
+         {
+            int f = i / size;
+            string file = "f" + to_string(f);
+            int block = next[f] > 0 ? next[f] : fsys.getfirstblock(file);
+            fsys.readblock(file, block, data.data());
+            next[f] = fsys.nextblock(file, block);
+         }));
+         report(measure("fs.delblock" + shape, count * size, [&](int i)
+         {
+            string file = "f" + to_string(i / size);
+            fsys.delblock(file, fsys.getfirstblock(file));
+         }));
+         report(measure("fs.rmfile" + shape, count, [&](int i)
+         {
+            fsys.rmfile("f" + to_string(i));
+         }));
+         fsys.endbatch();
+      }
+   }
+   remove("benchfs");
+   Filesys fsys("benchfs", numberofblocks, blocksize);
+   report(measure("fs.fssynch", 20, [&](int)
+   {
+      fsys.newfile("s"); //one change, one commit
+      fsys.rmfile("s");
+   }));
+   int chain = min(2048, numberofblocks / 2);
+   fsys.startbatch();
+   fsys.newfile("long");
+   fsys.addblocks("long", blockviews(string((size_t)chain * blocksize, 'l'), blocksize));
+   fsys.endbatch();
+   vector<int> blocks;
+   for(int b = fsys.getfirstblock("long"); b > 0; b = fsys.nextblock("long", b))
+   {
+      blocks.push_back(b);
+   }
+   mt19937 random(2);
+   vector<char> data(blocksize);
+   report(measure("fs.random chain=" + to_string(chain), 2000, [&](int)
+   {
+      fsys.readblock("long", blocks[random() % blocks.size()], data.data());
+   }));
+   fsys.pin("long");
+   report(measure("fs.random pinned chain=" + to_string(chain), 2000, [&](int)
+   {
+      fsys.readblock("long", blocks[random() % blocks.size()], data.data());
+   }));
+   fsys.unpin("long");
+   long long touched = 0;
+   report(measure("fs.mapfile chain=" + to_string(chain), 200, [&](int)
+   {
+      Fileview view;
+      fsys.mapfile("long", view);
+      for(size_t at = 0; at < view.size(); at += blocksize)
+      {
+         touched += view.data()[at]; //every block, as a parser would
+      }
+   }));
+   remove("benchfs");
+}
+
+static void copies(int numberofblocks, int blocksize)
+{
+   remove("benchshell");
+   Shell shell("benchshell", numberofblocks, blocksize);
+   int size = min(1024, numberofblocks / 3);
+   shell.newfile("a");
+   shell.addblocks("a", blockviews(string((size_t)size * blocksize, 'c'), blocksize));
+   Result r = measure("shell.copy size=" + to_string(size), 5, [&](int)
+   {
+      shell.copy("a", "b");
+      shell.del("b"); //the copy makes the next one possible
+   });
+   r.extra = "each op copies and deletes";
+   report(r);
+   remove("benchshell");
+}
+
+static void fixed(int passes)
+{
+   const int blocksize = 512;
+   int fileblocks = 1024;
+   remove("benchfixed");
+   Fixedfs<blocksize> fsys("benchfixed", 4096);
+   fsys.newfile("f");
+   fsys.addblocks("f", blockviews(string((size_t)fileblocks * blocksize, 'f'), blocksize));
+   vector<int> blocks;
+   for(int b = fsys.getfirstblock("f"); b > 0; b = fsys.nextblock("f", b))
+   {
+      blocks.push_back(b);
+   }
+   int ops = passes * fileblocks;
+   Fixedfs<blocksize>::Block buffer = Fixedfs<blocksize>::fill("fixed");
+   report(measure("fixed.getblock runtime", ops, [&](int i)
+   {
+      fsys.getblock(blocks[i % blocks.size()], (char*)buffer.data());
+   }));
+   report(measure("fixed.getblock compile-time", ops, [&](int i)
+   {
+      fsys.getfixed<blocksize>(blocks[i % blocks.size()], buffer.data());
+   }));
+   report(measure("fixed.readblock runtime", ops, [&](int i)
+   {
+      fsys.readblock("f", blocks[i % blocks.size()], (char*)buffer.data());
+   }));
+   report(measure("fixed.readblock compile-time", ops, [&](int i)
+   {
+      fsys.readblock("f", blocks[i % blocks.size()], buffer);
+   }));
+   report(measure("fixed.writeblock runtime", ops, [&](int i)
+   {
+      fsys.writeblock("f", blocks[i % blocks.size()], string_view(buffer.data(), blocksize));
+   }));
+   report(measure("fixed.writeblock compile-time", ops, [&](int i)
+   {
+      fsys.writeblock("f", blocks[i % blocks.size()], buffer);
+   }));
+   remove("benchfixed");
+}
+
+static void readers(int maxthreads, int passes)
+{
+   const int blocksize = 512;
+   int numberofblocks = 4096;
+   int fileblocks = 32;
+   remove("benchdisk");
+   Fixedfs<blocksize> fsys("benchdisk", numberofblocks);
+   for(int t = 0; t < maxthreads; t++)
+   {
+      string file = "bench" + to_string(t);
+      fsys.newfile(file);
+      Fixedfs<blocksize>::Block buffer = Fixedfs<blocksize>::fill(string(blocksize, 'a' + t % 26));
+      for(int i = 0; i < fileblocks; i++)
+      {
+         fsys.addblock(file, buffer);
+      }
+   }
+   for(int threads = 1; threads <= maxthreads; threads *= 2)
+   {
+      vector<vector<long long> > latencies(threads);
+      long long start = Histogram::now();
+      vector<thread> workers;
+      for(int t = 0; t < threads; t++)
+      {
+         workers.push_back(thread([&fsys, &latencies, t, passes, fileblocks]()
+         {
+            string file = "bench" + to_string(t);
+            latencies[t].reserve(passes * fileblocks);
+            for(int p = 0; p < passes; p++)
+            {
+               Fixedfs<blocksize>::Block buffer;
+               int block = fsys.getfirstblock(file);
+               while(block > 0)
+               {
+                  long long before = Histogram::now();
+                  fsys.readblock(file, block, buffer);
+                  block = fsys.nextblock(file, block);
+                  latencies[t].push_back(Histogram::now() - before);
+               }
+            }
+         }));
+      }
+      for(int t = 0; t < workers.size(); t++)
+      {
+         workers[t].join();
+      }
+      Result r;
+      r.name = "readers threads=" + to_string(threads);
+      r.seconds = (Histogram::now() - start) / 1e9;
+      for(int t = 0; t < threads; t++)
+      {
+         r.latencies.insert(r.latencies.end(), latencies[t].begin(), latencies[t].end());
+      }
+      r.ops = r.latencies.size();
+      r.extra = "readblock + nextblock";
+      report(r);
+   }
+   remove("benchdisk");
+}
+
+static void writejson(const char* path, int threads, int passes, int numberofblocks, int blocksize)
+{
+   FILE* out = fopen(path, "w");
+   if(out == NULL)
+   {
+      cout << path << " cannot be written" << endl;
+      return;
+   }
+   fprintf(out, "{\"threads\":%d,\"passes\":%d,\"blocks\":%d,\"blocksize\":%d,\"results\":[",
+           threads, passes, numberofblocks, blocksize);
+   for(int i = 0; i < results.size(); i++)
+   {
+      Result& r = results[i];
+      fprintf(out, "%s\n{\"case\":\"%s\",\"ops\":%lld,\"seconds\":%.6f,\"ops_per_sec\":%.1f,"
+              "\"p50_us\":%.3f,\"p99_us\":%.3f,\"extra\":\"%s\"}", i > 0 ? "," : "",
+              r.name.c_str(), r.ops, r.seconds, r.ops / r.seconds,
+              percentile(r.latencies, 50), percentile(r.latencies, 99), r.extra.c_str());
+   }
+   fprintf(out, "\n]}\n");
+   fclose(out);
+}
+
+int main(int argc, char* argv[])
+{
+   int maxthreads = argc > 1 ? atoi(argv[1]) : (int)thread::hardware_concurrency();
+   int passes = argc > 2 ? atoi(argv[2]) : 20;
+   int numberofblocks = argc > 3 ? atoi(argv[3]) : 16384;
+   int blocksize = argc > 4 ? atoi(argv[4]) : 512;
+   if(maxthreads < 1)
+   {
+      maxthreads = 1;
+   }
+   if(numberofblocks < 256 || blocksize < 128)
+   {
+      cout << "usage: " << argv[0] << " [threads] [passes] [blocks >= 256] [blocksize >= 128] [output.json]" << endl;
+      return 1;
+   }
+
+   printf("%-34s %8s %11s %9s %9s\n", "case", "ops", "ops/sec", "p50 us", "p99 us");
+   rawdisk(numberofblocks, blocksize);
+   files(numberofblocks, blocksize);
+   copies(numberofblocks, blocksize);
+   fixed(passes);
+   readers(maxthreads, passes);
+   stream(false, passes);
+   stream(true, passes);
+   remove("benchstream");
+   if(argc > 5)
+   {
+      writejson(argv[5], maxthreads, passes, numberofblocks, blocksize);
+   }
+   return 0;
+}
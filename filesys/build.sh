@@ -1 +1,6 @@
-g++ -o FS main.cpp filesys.cpp sdisk.cpp
\ No newline at end of file
+g++ -pthread -o FS main.cpp filesys.cpp sdisk.cpp fat.cpp directory.cpp stats.cpp zdisk.cpp lz.cpp shell.cpp defrag.cpp
+g++ -pthread -o SHELL shellmain.cpp filesys.cpp sdisk.cpp fat.cpp directory.cpp stats.cpp zdisk.cpp lz.cpp shell.cpp defrag.cpp
+g++ -pthread -o FSCK fsckmain.cpp filesys.cpp sdisk.cpp fat.cpp directory.cpp stats.cpp zdisk.cpp lz.cpp fsck.cpp
+g++ -O2 -pthread -o BENCH bench.cpp filesys.cpp sdisk.cpp fat.cpp directory.cpp stats.cpp zdisk.cpp lz.cpp shell.cpp defrag.cpp
+g++ -pthread -o FSD servermain.cpp server.cpp filesys.cpp sdisk.cpp fat.cpp directory.cpp stats.cpp zdisk.cpp lz.cpp
+g++ -pthread -o FSC clientmain.cpp server.cpp filesys.cpp sdisk.cpp fat.cpp directory.cpp stats.cpp zdisk.cpp lz.cpp
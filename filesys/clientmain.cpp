@@ -0,0 +1,139 @@
+// Drives a running FSD from several processes at once and checks that
+// every acknowledged write reads back:
+//    ./FSC socketpath blocksize [processes] [blocks]
+
+#include "sdisk.h"
+#include "filesys.h"
+#include "server.h"
+#include <cstdlib>
+#include <chrono>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/wait.h>
+
+static string content(int process, int block, int version, int blocksize)
+{
+   string data = to_string(process) + " " + to_string(block) + " " + to_string(version) + " ";
+   string buffer(blocksize, 'a' + (process + block + version) % 26);
+   buffer.replace(0, data.size(), data);
+   return buffer;
+}
+
+// deletes every block of file, then the file
+static void clear(Client& client, string file)
+{
+   for(int b = client.getfirstblock(file); b > 0; b = client.getfirstblock(file))
+   {
+      if(client.delblock(file, b) != 1)
+      {
+         break;
+      }
+   }
+   client.rmfile(file);
+}
+
+// one client: adds blocks, half pipelined and half one at a time,
+// rewrites every fourth, then reads the file back; returns bad blocks
+static int work(string socketpath, int process, int blocks, int blocksize)
+{
+   Client client(socketpath);
+   if(!client.connected())
+   {
+      cout << "process " << process << ": cannot connect to " << socketpath << endl;
+      return blocks;
+   }
+   string file = "c" + to_string(process);
+   vector<string> names = client.ls();
+   if(find(names.begin(), names.end(), file) != names.end())
+   {
+      clear(client, file); //left over from an earlier run
+   }
+   if(client.newfile(file) != 1)
+   {
+      cout << "process " << process << ": cannot create " << file << endl;
+      return blocks;
+   }
+   vector<string> expected;
+   for(int i = 0; i < blocks; i++)
+   {
+      expected.push_back(content(process, i, 0, blocksize));
+   }
+   int half = blocks / 2;
+   vector<string_view> first(expected.begin(), expected.begin() + half);
+   int added = client.addblocks(file, first);
+   for(int i = half; i < blocks; i++)
+   {
+      if(client.addblock(file, expected[i]) == 1)
+      {
+         added++;
+      }
+   }
+   int bad = blocks - added;
+   vector<int> numbers;
+   for(int b = client.getfirstblock(file); b > 0; b = client.nextblock(file, b))
+   {
+      numbers.push_back(b);
+   }
+   for(int i = 0; i < numbers.size() && i < blocks; i += 4)
+   {
+      expected[i] = content(process, i, 1, blocksize);
+      if(client.writeblock(file, numbers[i], expected[i]) != 1)
+      {
+         bad++;
+      }
+   }
+   for(int i = 0; i < numbers.size() && i < blocks; i++)
+   {
+      string buffer;
+      if(client.readblock(file, numbers[i], buffer) != 1 || buffer != expected[i])
+      {
+         bad++;
+      }
+   }
+   if(numbers.size() != blocks)
+   {
+      cout << "process " << process << ": " << file << " has " << numbers.size() << " blocks, expected " << blocks << endl;
+      bad++;
+   }
+   clear(client, file);
+   return bad;
+}
+
+int main(int argc, char* argv[])
+{
+   if(argc < 3)
+   {
+      cout << "usage: " << argv[0] << " socketpath blocksize [processes] [blocks]" << endl;
+      return 1;
+   }
+   string socketpath = argv[1];
+   int blocksize = atoi(argv[2]);
+   int processes = argc > 3 ? atoi(argv[3]) : 8;
+   int blocks = argc > 4 ? atoi(argv[4]) : 64;
+   long long start = Histogram::now();
+   vector<pid_t> children;
+   for(int p = 0; p < processes; p++)
+   {
+      pid_t child = fork();
+      if(child == 0)
+      {
+         int bad = work(socketpath, p, blocks, blocksize);
+         _exit(bad == 0 ? 0 : 1);
+      }
+      children.push_back(child);
+   }
+   int failed = 0;
+   for(int p = 0; p < children.size(); p++)
+   {
+      int status;
+      if(waitpid(children[p], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      {
+         failed++;
+      }
+   }
+   double seconds = (Histogram::now() - start) / 1e9;
+   long long writes = (long long)processes * (blocks + (blocks + 3) / 4);
+   cout << processes << " processes, " << writes << " acknowledged writes in " << seconds << " s, "
+        << (long long)(writes / seconds) << " writes/s, " << failed << " processes saw bad blocks" << endl;
+   return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,201 @@
+#include "sdisk.h"
+#include "filesys.h"
+#include "defrag.h"
+#include <chrono>
+#include <thread>
+
+Defrag::Defrag(Filesys& fsys): fsys(fsys)
+{
+}
+string Defrag::report()
+{
+   shared_lock<shared_mutex> dl(fsys.dirlock);
+   int n = fsys.getnumberofblocks();
+   int datastart = fsys.fatsize + 1;
+   int dataend = fsys.dataend();
+   int files = 0;
+   int blocks = 0;
+   int extents = 0;
+   vector<bool> used(n, false);
+   for(int c = 0; c < fsys.rootsize; c++)
+   {
+      if(!fsys.root.used(c) || fsys.root.first(c) <= 0 || fsys.root.first(c) >= n)
+      {
+         continue;
+      }
+      shared_lock<shared_mutex> fl(fsys.filelock[c]);
+      files++;
+      int prev = -1;
+      for(int b = fsys.root.first(c); b != 0; b = fsys.fat[b])
+      {
+         if(b != prev + 1)
+         {
+            extents++; //a new run starts wherever the chain jumps
+         }
+         used[b] = true;
+         blocks++;
+         prev = b;
+      }
+   }
+   int freeruns = 0;
+   int largest = 0;
+   int run = 0;
+   for(int b = datastart; b < dataend; b++)
+   {
+      run = used[b] ? 0 : run + 1;
+      if(run == 1)
+      {
+         freeruns++;
+      }
+      if(run > largest)
+      {
+         largest = run;
+      }
+   }
+   ostringstream out;
+   out << files << " files, " << blocks << " blocks in " << extents << " extents, "
+       << freeruns << " free runs (largest " << largest << ")";
+   return out.str();
+}
+int Defrag::run(int batchblocks, int pausems)
+{
+   if(batchblocks < 1)
+   {
+      batchblocks = 1;
+   }
+   int total = 0;
+   int moved = batch(batchblocks);
+   while(moved > 0)
+   {
+      total += moved;
+      this_thread::sleep_for(chrono::milliseconds(pausems)); //let other work in between batches
+      moved = batch(batchblocks);
+   }
+   return total;
+}
+int Defrag::batch(int limit)
+{
+   vector<int> sources;
+   vector<int> targets;
+   {
+      unique_lock<shared_mutex> dl(fsys.dirlock);
+      int n = fsys.getnumberofblocks();
+      int datastart = fsys.fatsize + 1;
+      int dataend = fsys.dataend();
+      vector<vector<int> > chains(fsys.rootsize);
+      vector<int> ownerfile(n, -1);   //file slot holding each block
+      vector<int> ownerindex(n, 0);   //position of the block in that file
+      for(int c = 0; c < chains.size(); c++)
+      {
+         if(!fsys.root.used(c))
+         {
+            continue;
+         }
+         for(int b = fsys.root.first(c); b > 0 && b < n; b = fsys.fat[b]) //inline files have no chain
+         {
+            ownerfile[b] = c;
+            ownerindex[b] = chains[c].size();
+            chains[c].push_back(b);
+         }
+      }
+      //space free now may take data; space freed by this batch, or in
+      //limbo until the next commit, waits
+      vector<bool> usable(n, false);
+      for(int b = datastart; b < dataend; b++)
+      {
+         usable[b] = ownerfile[b] < 0 && !fsys.inlimbo[b];
+      }
+      vector<bool> moved(n, false);   //indexed by source block
+      vector<bool> placed(n, false);  //targets of this batch, their data is not there yet
+      int spare = dataend - 1;        //evicted blocks go to the top of the disk
+      int cursor = datastart;
+      for(int c = 0; c < chains.size() && sources.size() < limit; c++)
+      {
+         for(int k = 0; k < chains[c].size() && sources.size() < limit; k++, cursor++)
+         {
+            int b = chains[c][k];
+            int t = cursor;
+            if(b == t || moved[b] || placed[b])
+            {
+               continue;
+            }
+            if(usable[t])
+            {
+               usable[t] = false;
+               placed[t] = true;
+               moved[b] = true;
+               chains[c][k] = t;
+               sources.push_back(b);
+               targets.push_back(t);
+            }
+            else if(ownerfile[t] >= 0 && !moved[t])
+            {
+               //someone else sits on our spot; move them out of the way
+               while(spare > t && !usable[spare])
+               {
+                  spare--;
+               }
+               if(spare <= t)
+               {
+                  continue;
+               }
+               usable[spare] = false;
+               placed[spare] = true;
+               moved[t] = true;
+               chains[ownerfile[t]][ownerindex[t]] = spare;
+               sources.push_back(t);
+               targets.push_back(spare);
+            }
+         }
+      }
+      if(sources.size() == 0)
+      {
+         return 0;
+      }
+      //copy the data before any metadata points at it
+      vector<string> buffers;
+      fsys.getblocks(sources, buffers);
+      fsys.putblocks(targets, buffers);
+      for(int k = 0; k < sources.size(); k++)
+      {
+         //the in-memory copy of a pinned block moves with it
+         int c = ownerfile[sources[k]];
+         if(!fsys.pinned[c])
+         {
+            continue;
+         }
+         auto node = fsys.pindata[c].extract(sources[k]);
+         if(!node.empty())
+         {
+            node.key() = targets[k];
+            fsys.pindata[c].insert(move(node));
+         }
+      }
+      vector<bool> used(n, false);
+      for(int c = 0; c < chains.size(); c++)
+      {
+         if(chains[c].size() == 0)
+         {
+            continue;
+         }
+         fsys.root.first(c) = chains[c][0];
+         for(int k = 0; k < chains[c].size(); k++)
+         {
+            used[chains[c][k]] = true;
+            fsys.fat[chains[c][k]] = k + 1 < chains[c].size() ? chains[c][k + 1] : 0;
+         }
+         fsys.lastblock[c] = chains[c].back();
+      }
+      vector<int> freelist; //ascending, so later allocations run contiguous
+      for(int b = datastart; b < dataend; b++)
+      {
+         if(!used[b])
+         {
+            freelist.push_back(b);
+         }
+      }
+      fsys.setfree(freelist);
+   }
+   fsys.fssynch(); //one commit per batch
+   return sources.size();
+}
@@ -0,0 +1,24 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Online defragmenter for a mounted Filesys. Files are laid out in ROOT
+// order, each in one contiguous run from the first data block, and the
+// free chain is rebuilt in ascending order so new blocks come out
+// contiguous too. Work is done in batches: a batch holds the file system
+// for at most batchblocks block moves, copies all their data with one
+// getblocks/putblocks pair, relinks the FAT and commits with one fssynch.
+// Blocks are only ever copied into space that was free when the batch
+// began, so a crash mid-batch leaves the last commit intact.
+class Defrag
+{
+   public:
+      Defrag(Filesys& fsys);
+      string report();        // files, extents and free runs as one line
+      int run(int batchblocks, int pausems); // returns blocks moved
+   private:
+      int batch(int limit);   // plans and does one batch, returns blocks moved
+      Filesys& fsys;
+};
@@ -0,0 +1,110 @@
+#include "directory.h"
+#include <cstring>
+
+// a record is the first block, the name length, then the name
+static const int nameat = sizeof(int) + sizeof(unsigned short);
+
+Directory::Directory()
+{
+   count = 0;
+   width = 0;
+   stride = 0;
+   widen(26); //32 byte records hold most names
+}
+void Directory::format(int slots)
+{
+   count = slots;
+   arena.assign((size_t)count * stride / sizeof(int), 0);
+   inuse.assign((count + 63) / 64, 0);
+}
+int Directory::slots()
+{
+   return count;
+}
+bool Directory::used(int slot)
+{
+   return (inuse[slot >> 6] >> (slot & 63)) & 1;
+}
+char* Directory::record(int slot)
+{
+   return (char*)arena.data() + (size_t)slot * stride;
+}
+string_view Directory::name(int slot)
+{
+   if(!used(slot))
+   {
+      return "xxxxx";
+   }
+   unsigned short length;
+   memcpy(&length, record(slot) + sizeof(int), sizeof(length));
+   return string_view(record(slot) + nameat, length);
+}
+int& Directory::first(int slot)
+{
+   return *(int*)record(slot);
+}
+int Directory::find(string_view file, int& probes)
+{
+   //only slots in use are compared, a word of the bitmap at a time
+   probes = 0;
+   if(file.size() > width)
+   {
+      return -1; //no record is that wide
+   }
+   unsigned short length = file.size();
+   for(int w = 0; w < inuse.size(); w++)
+   {
+      for(unsigned long long bits = inuse[w]; bits != 0; bits &= bits - 1)
+      {
+         int slot = w * 64 + __builtin_ctzll(bits);
+         const char* r = record(slot);
+         probes++;
+         if(memcmp(r + sizeof(int), &length, sizeof(length)) == 0 && memcmp(r + nameat, file.data(), length) == 0)
+         {
+            return slot;
+         }
+      }
+   }
+   return -1;
+}
+int Directory::freeslot()
+{
+   for(int w = 0; w < inuse.size(); w++)
+   {
+      if(~inuse[w] != 0)
+      {
+         int slot = w * 64 + __builtin_ctzll(~inuse[w]);
+         return slot < count ? slot : -1;
+      }
+   }
+   return -1;
+}
+void Directory::set(int slot, string_view file)
+{
+   if(file.size() > width)
+   {
+      widen(file.size());
+   }
+   unsigned short length = file.size();
+   char* r = record(slot);
+   memcpy(r + sizeof(int), &length, sizeof(length));
+   memcpy(r + nameat, file.data(), length);
+   inuse[slot >> 6] |= 1ULL << (slot & 63);
+}
+void Directory::free(int slot)
+{
+   inuse[slot >> 6] &= ~(1ULL << (slot & 63));
+}
+void Directory::widen(int names)
+{
+   //records stay a multiple of 8 bytes, so first() is always an aligned int
+   int newstride = (nameat + names + 7) / 8 * 8;
+   vector<int> wider((size_t)count * newstride / sizeof(int), 0);
+   for(int slot = 0; slot < count; slot++)
+   {
+      memcpy((char*)wider.data() + (size_t)slot * newstride, record(slot), stride);
+   }
+   arena.swap(wider);
+   stride = newstride;
+   width = newstride - nameat;
+}
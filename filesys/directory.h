@@ -0,0 +1,36 @@
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace std;
+
+// ROOT in memory: one arena of fixed-size records, each a first block
+// and a name held inline, and a bitmap of the slots in use. Records are
+// as wide as the longest name needs; a longer one widens them all once.
+// A scan walks the bitmap and one stretch of memory, and nothing is
+// allocated per entry. A free slot reads as "xxxxx", as it is on disk.
+//
+// Readers may run at once; set, free and format need the owner's
+// exclusive lock, since widening moves every record.
+class Directory
+{
+   public:
+      Directory();
+      void format(int slots);        // every slot free
+      int slots();
+      bool used(int slot);
+      string_view name(int slot);    // "xxxxx" for a free slot
+      int& first(int slot);          // first block of the file in slot
+      int find(string_view file, int& probes); // slot holding file or -1; probes counts records compared
+      int freeslot();                // lowest free slot, -1 if none
+      void set(int slot, string_view file); // slot holds file from now on
+      void free(int slot);
+   private:
+      char* record(int slot);
+      void widen(int width);         // room for names of width bytes
+      vector<int> arena;             // slots records of stride bytes, each starting on an int
+      vector<unsigned long long> inuse; // bit per slot
+      int count;                     // slots
+      int width;                     // name bytes per record
+      int stride;                    // bytes per record: first, length, name
+};
@@ -0,0 +1,310 @@
+#include "sdisk.h"
+#include "fat.h"
+#include <sstream>
+#include <cstdio>
+
+Fat::Fat()
+{
+   disk = NULL;
+   first = blocks = entries = 0;
+   width = 6;
+   pagesize = pageblocks = 1;
+   shift = 0;
+   limit = 256;
+   repeat = false;
+   loaded = 0;
+   clock = 0;
+}
+Fat::~Fat()
+{
+   for(int p = 0; p < pages.size(); p++)
+   {
+      delete pages[p].load();
+   }
+}
+void Fat::attach(Sdisk* disk, int first, int blocks, int entries, int width)
+{
+   this->disk = disk;
+   this->first = first;
+   this->blocks = blocks;
+   this->entries = entries;
+   this->width = width;
+   //a page is the fewest whole blocks holding whole entries, repeated
+   //until it has at least 1024 of them
+   int blocksize = disk->getblocksize();
+   int a = blocksize;
+   int b = width;
+   while(b != 0)
+   {
+      int t = a % b;
+      a = b;
+      b = t;
+   }
+   int unit = blocksize / a; //entries in blocksize * width / gcd bytes
+   pagesize = unit * ((1024 + unit - 1) / unit);
+   shift = -1;
+   for(int k = 0; k < 31; k++)
+   {
+      if(pagesize == (1 << k))
+      {
+         shift = k; //the usual power of two block size makes this a shift
+      }
+   }
+   pageblocks = (long long)pagesize * width / blocksize;
+   pages = vector<atomic<Page*> >((entries + pagesize - 1) / pagesize);
+   for(int p = 0; p < pages.size(); p++)
+   {
+      pages[p] = NULL;
+   }
+}
+int Fat::size()
+{
+   return entries;
+}
+bool Fat::paged()
+{
+   //entry 1 names a FAT block, so older disks always hold 0 there; a
+   //fixed width FAT keeps its width in it
+   string text;
+   disk->getblock(first, text);
+   if(text.size() < 2 * width || get(1) != width)
+   {
+      return false;
+   }
+   for(int i = 0; i < 2 * width; i += width)
+   {
+      if(text[i + width - 1] != ' ' || text[i + width - 2] < '0' || text[i + width - 2] > '9')
+      {
+         return false; //numbers do not end where fixed width entries would
+      }
+   }
+   return true;
+}
+void Fat::parse(const string& text)
+{
+   istringstream fatstream(text);
+   lock_guard<mutex> fl(faultlock);
+   for(int p = 0; p < pages.size(); p++)
+   {
+      Page* page = pages[p] != NULL ? pages[p].load() : make();
+      for(int k = 0; k < pagesize; k++)
+      {
+         int n = 0;
+         fatstream >> n;
+         page->entries[k] = n;
+      }
+      page->dirty = true; //goes back out in the fixed width form
+      pages[p] = page;
+   }
+}
+void Fat::format(int datastart, int dataend)
+{
+   lock_guard<mutex> fl(faultlock);
+   for(int p = 0; p < pages.size(); p++)
+   {
+      Page* page = pages[p] != NULL ? pages[p].load() : make();
+      for(int k = 0; k < pagesize; k++)
+      {
+         int i = p * pagesize + k;
+         if(i == 0)
+         {
+            page->entries[k] = datastart; //free chain head
+         }
+         else if(i < datastart || i + 1 >= dataend)
+         {
+            page->entries[k] = 0;
+         }
+         else
+         {
+            page->entries[k] = i + 1;
+         }
+      }
+      page->dirty = true;
+      pages[p] = page;
+   }
+}
+void Fat::touch(int index)
+{
+   int page = index / pagesize;
+   if(pages[page] == NULL)
+   {
+      fault(page); //not resident: its disk copy is what gets patched
+   }
+   pages[page].load()->dirty = true;
+}
+void Fat::flush(const vector<pair<int,int> >& patches, int target, vector<int>& blocknumbers, vector<string>& buffers)
+{
+   //every changed page as blocks from target on, with patches laid over
+   //the entries they name; caller keeps every writer out until this
+   //returns. Pages patched last time are rewritten too, so stale patches
+   //go away.
+   for(int i = 0; i < patched.size(); i++)
+   {
+      touch(patched[i]);
+   }
+   for(int i = 0; repeat && i < flushed.size(); i++)
+   {
+      touch(flushed[i] * pagesize);
+   }
+   flushed.clear();
+   for(int i = 0; i < patches.size(); i++)
+   {
+      touch(patches[i].first);
+   }
+   patched.clear();
+   for(int i = 0; i < patches.size(); i++)
+   {
+      patched.push_back(patches[i].first);
+   }
+   int blocksize = disk->getblocksize();
+   char field[32];
+   for(int p = 0; p < pages.size(); p++)
+   {
+      Page* page = pages[p];
+      if(page == NULL || !page->dirty)
+      {
+         continue;
+      }
+      string text;
+      int count = entries - p * pagesize < pagesize ? entries - p * pagesize : pagesize;
+      for(int k = 0; k < count; k++)
+      {
+         snprintf(field, sizeof(field), "%*d ", width - 1, page->entries[k]);
+         text += field;
+      }
+      for(int i = 0; i < patches.size(); i++)
+      {
+         int k = patches[i].first - p * pagesize;
+         if(k >= 0 && k < count)
+         {
+            snprintf(field, sizeof(field), "%*d ", width - 1, patches[i].second);
+            text.replace(k * width, width, field);
+         }
+      }
+      for(int b = 0; b < pageblocks && p * pageblocks + b < blocks && b * blocksize < text.size(); b++)
+      {
+         blocknumbers.push_back(target + p * pageblocks + b);
+         buffers.push_back(text.substr(b * blocksize, blocksize)); //putblock pads the last one
+      }
+      page->writing = true;
+      page->dirty = false;
+      flushed.push_back(p);
+   }
+}
+void Fat::written()
+{
+   for(int i = 0; i < flushed.size(); i++)
+   {
+      Page* page = pages[flushed[i]];
+      if(page != NULL)
+      {
+         page->writing = false;
+      }
+   }
+}
+void Fat::relocate(int first)
+{
+   this->first = first;
+}
+void Fat::twocopies(bool on)
+{
+   repeat = on;
+}
+bool Fat::over()
+{
+   return loaded > limit;
+}
+int Fat::resident()
+{
+   return loaded;
+}
+long long Fat::faults()
+{
+   return faulted.value();
+}
+void Fat::resetfaults()
+{
+   faulted.reset();
+}
+void Fat::fault(int page)
+{
+   faulted.add(1);
+   vector<int> numbers;
+   for(int b = 0; b < pageblocks && page * pageblocks + b < blocks; b++)
+   {
+      numbers.push_back(first + page * pageblocks + b);
+   }
+   vector<string> buffers;
+   disk->getblocks(numbers, buffers);
+   string text;
+   for(int b = 0; b < buffers.size(); b++)
+   {
+      text += buffers[b];
+   }
+   vector<int> values(pagesize, 0);
+   for(int k = 0; k < pagesize && (k + 1) * width <= text.size(); k++)
+   {
+      int n = 0;
+      for(int c = k * width; c < (k + 1) * width; c++)
+      {
+         if(text[c] >= '0' && text[c] <= '9')
+         {
+            n = n * 10 + (text[c] - '0');
+         }
+      }
+      values[k] = n;
+   }
+
+   lock_guard<mutex> fl(faultlock);
+   if(pages[page] == NULL)
+   {
+      //another thread may have loaded it while we read
+      for(int i = 0; i < patched.size(); i++)
+      {
+         if(patched[i] / pagesize == page)
+         {
+            values[patched[i] % pagesize] = 0; //patches exist on disk only
+         }
+      }
+      Page* p = make();
+      p->entries.swap(values);
+      p->dirty = false;
+      p->writing = false;
+      p->used = ++clock;
+      pages[page] = p; //whole before anyone sees it
+   }
+}
+Fat::Page* Fat::make()
+{
+   Page* p = new Page;
+   p->entries = vector<int>(pagesize, 0);
+   p->dirty = true;
+   p->writing = false;
+   p->used = clock.load();
+   loaded++;
+   return p;
+}
+void Fat::evict()
+{
+   //drops the least recently used clean pages until under the limit;
+   //changed pages stay until they are flushed and written
+   while(loaded > limit)
+   {
+      int victim = -1;
+      for(int p = 0; p < pages.size(); p++)
+      {
+         Page* page = pages[p];
+         if(page != NULL && !page->dirty && !page->writing && (victim < 0 || page->used < pages[victim].load()->used))
+         {
+            victim = p;
+         }
+      }
+      if(victim < 0)
+      {
+         return;
+      }
+      delete pages[victim].load();
+      pages[victim] = NULL;
+      loaded--;
+   }
+}
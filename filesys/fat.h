@@ -0,0 +1,139 @@
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+
+using namespace std;
+
+// The FAT as fixed pages of entries loaded from disk when a chain first
+// touches them. Each entry is stored as width characters, the number
+// right aligned and a space after it, so entry i sits at byte i * width
+// of the FAT blocks and a page is found without parsing what precedes
+// it. A page spans whole blocks. Clean pages beyond the limit are
+// evicted least recently used first. Changed pages stay in memory until
+// flush hands them to fssynch and written says they are on disk. With
+// two alternating copies of the FAT, each flush repeats the pages of the
+// flush before it so both copies catch up. fat[b] reads and assigns like the
+// vector<int> it replaces. Patched entries (the joins between group free
+// chains, and bookkeeping in the FAT's own entries) differ on disk only,
+// and every patched entry reads back as 0.
+//
+// get, set and touch may run at once from many threads; a page is never
+// freed under them because flush and evict must run alone, which the
+// owner ensures with its own lock.
+class Fat
+{
+   public:
+      class Entry
+      {
+         public:
+            Entry(Fat& fat, int index);
+            operator int() const;
+            Entry& operator=(int value);
+            Entry& operator=(const Entry& other);
+         private:
+            Fat& fat;
+            int index;
+      };
+      Fat();
+      ~Fat();
+      void attach(Sdisk* disk, int first, int blocks, int entries, int width);
+      Entry operator[](int index);
+      int get(int index);
+      void set(int index, int value);
+      int size();
+      bool paged();             // the disk holds a fixed width FAT; loads its first page
+      void parse(const string& text); // variable width FAT of older disks, all pages changed
+      void format(int datastart, int dataend); // empty file system: one free chain over the data blocks
+      void touch(int index);    // rewrite the page holding index at the next flush
+      void flush(const vector<pair<int,int> >& patches, int target, vector<int>& blocknumbers, vector<string>& buffers);
+      void written();           // the blocks of the last flush are on disk
+      void relocate(int first); // FAT blocks now start at first
+      void twocopies(bool on);  // each flush also repeats the pages of the one before
+      bool over();              // more pages in memory than the limit
+      void evict();             // drops the least recently used clean pages
+      int resident();           // pages in memory
+      long long faults();       // pages read from disk
+      void resetfaults();
+   private:
+      struct Page
+      {
+         vector<int> entries;
+         atomic<bool> dirty;
+         atomic<bool> writing;   // flushed, not yet on disk: must not be evicted
+         atomic<long long> used; // clock at the last access
+      };
+      void fault(int page);    // reads page from disk and makes it resident
+      Page* make();            // empty page, counted as resident; caller holds faultlock
+      Sdisk* disk;
+      atomic<int> first;       // first FAT block to read pages from
+      int blocks;              // FAT blocks
+      int entries;             // one per disk block
+      int width;               // characters per entry
+      int pagesize;            // entries per page
+      int shift;               // log2 of pagesize, -1 if not a power of two
+      int pageblocks;          // blocks per page
+      int limit;               // resident pages before clean ones go
+      atomic<int> loaded;      // resident pages
+      vector<atomic<Page*> > pages;
+      vector<int> patched;     // entries the last flush patched; 0 in memory
+      vector<int> flushed;     // pages of the last flush
+      bool repeat;             // twocopies
+      atomic<long long> clock; // counts page faults
+      Counter faulted;         // faults, for stats
+      mutex faultlock;         // one thread adds a page at a time
+};
+
+// Entry access is on every chain walk, so it is inlined here.
+inline Fat::Entry::Entry(Fat& fat, int index): fat(fat), index(index)
+{
+}
+inline Fat::Entry::operator int() const
+{
+   return fat.get(index);
+}
+inline Fat::Entry& Fat::Entry::operator=(int value)
+{
+   fat.set(index, value);
+   return *this;
+}
+inline Fat::Entry& Fat::Entry::operator=(const Entry& other)
+{
+   fat.set(index, (int)other);
+   return *this;
+}
+inline Fat::Entry Fat::operator[](int index)
+{
+   return Entry(*this, index);
+}
+inline int Fat::get(int index)
+{
+   int page = shift >= 0 ? index >> shift : index / pagesize;
+   Page* p = pages[page];
+   if(p == NULL)
+   {
+      fault(page);
+      p = pages[page];
+   }
+   if(p->used != clock)
+   {
+      p->used = clock.load();
+   }
+   return p->entries[index - page * pagesize];
+}
+inline void Fat::set(int index, int value)
+{
+   int page = shift >= 0 ? index >> shift : index / pagesize;
+   Page* p = pages[page];
+   if(p == NULL)
+   {
+      fault(page);
+      p = pages[page];
+   }
+   if(p->used != clock)
+   {
+      p->used = clock.load();
+   }
+   p->entries[index - page * pagesize] = value;
+   p->dirty = true;
+}
@@ -6,6 +6,18 @@
 
 #include "sdisk.h"
 #include "filesys.h"
+#include <algorithm>
+#include <cstring>
+#include <sys/mman.h>
+
+static const string inlinename = ".inline"; //hidden file holding the inline payloads
+
+static string_view payload(string_view buffer)
+{
+   //a block without its '#' padding
+   int end = buffer.find_last_not_of('#');
+   return buffer.substr(0, end + 1);
+}
 
 vector<string> block(string buffer, int b)
 {
@@ -40,280 +52,737 @@ vector<string> block(string buffer, int b)
    return blocks;
 }
 
+vector<string_view> blockviews(string_view buffer, int b)
+{
+   //putblock pads the short last block, so nothing is copied
+   vector<string_view> blocks;
+   for(size_t start = 0; start < buffer.length(); start += b)
+   {
+      blocks.push_back(buffer.substr(start, b));
+   }
+   if(blocks.empty())
+   {
+      blocks.push_back(buffer); //block() gives one block of padding
+   }
+   return blocks;
+}
+
+Fileview::Fileview()
+{
+   base = NULL;
+   length = 0;
+   start = NULL;
+   bytes = 0;
+   direct = false;
+}
+Fileview::~Fileview()
+{
+   close();
+}
+const char* Fileview::data()
+{
+   return start;
+}
+size_t Fileview::size()
+{
+   return bytes;
+}
+string_view Fileview::view()
+{
+   return string_view(start, bytes);
+}
+bool Fileview::inplace()
+{
+   return direct;
+}
+void Fileview::close()
+{
+   if(base != NULL)
+   {
+      munmap(base, length);
+   }
+   base = NULL;
+   length = 0;
+   start = NULL;
+   bytes = 0;
+   direct = false;
+}
+
 Filesys::Filesys(string diskname, int numberofblocks, int blocksize): Sdisk(diskname,numberofblocks,blocksize)
 {
-      rootsize = getblocksize() / 12;
-      fatsize = ((getnumberofblocks() * 6) / getblocksize() ) + 1 ;
+   mount();
+}
+Filesys::Filesys(const vector<string>& disknames, int numberofblocks, int blocksize, int chunk): Sdisk(disknames,numberofblocks,blocksize,chunk)
+{
+   mount();
+}
+void Filesys::mount()
+{
+      rootsize = rootentries(getblocksize());
+      int width = fatwidth(getnumberofblocks());
+      fatsize = fatblocks(getnumberofblocks(), getblocksize());
+      //a second ROOT and FAT sit just below the superblock in the last
+      //block, which names the copy of the last commit
+      shadowbase = getnumberofblocks() - 2 - fatsize;
+      shadow = false;
+      area = 0;
+      generation = 0;
+      level = false; //the last commit's pages may be newer than the other copy
+      string super;
+      getblock(getnumberofblocks() - 1, super);
+      istringstream superstream(super);
+      string magic;
+      long long gen = 0;
+      int a = 0;
+      int n = 0;
+      int size = 0;
+      if(superstream >> magic >> gen >> a >> n >> size && magic == "shadow"
+         && n == getnumberofblocks() && size == fatsize && (a == 0 || a == 1))
+      {
+         shadow = true;
+         area = a;
+         generation = gen;
+      }
+      int rootblock = area == 1 ? shadowbase : 0;
+      fat.attach(this, rootblock + 1, fatsize, getnumberofblocks(), width);
+      filelock = vector<shared_mutex>(rootsize);
+      lastblock = vector<int>(rootsize, 0);
+      freed = vector<char>(getnumberofblocks(), 0);
+      batchdepth = 0;
+      dirty = false;
+      inlinelimit = 0;
+      inlinedirty = false;
+      inlinedata = vector<string>(rootsize);
+      inlimbo = vector<char>(getnumberofblocks(), 0);
+      bornin = vector<int>(getnumberofblocks(), -1);
+      snapshots = 0;
+      flushing = false;
+      unsynced = 0;
+      flushinterval = 0;
+      flushthreshold = 0;
+      flushstop = false;
+      pinned = vector<char>(rootsize, 0);
+      pindata = vector<unordered_map<int,string> >(rootsize);
+      pinnedblocks = 0;
+      heat = vector<atomic<int> >(rootsize);
+      pinreads = 0;
+      pinlimit = 0;
+      pinthreshold = 1;
 
       string buffer;
-      getblock(0,buffer);
+      getblock(rootblock,buffer);
+      bool paged = buffer[0] != '#';
+      bool claim = false;
    if(buffer[0] == '#')
    {   //no file system build root and fat
       ///Build Root
-      for(int i = 1; i <= rootsize; i++)
-      {
-            filename.push_back("xxxxx"); // push back "no file" identifiers
-            firstblock.push_back(0); 
-      }
+      root.format(rootsize); //every slot free, first block 0
       ///Build Fat
-      fat.push_back(fatsize+1); //fat[0] = root
-      for(int i = 1; i <= fatsize; i++)
-      {
-         fat.push_back(0); //fat[1:fatsize] = all zeros
-      }
-      for(int i = fatsize + 1; i < getnumberofblocks(); i++)
-      {
-            fat.push_back(i+1); //rest of fat
-      }
-      fat[fat.size()-1] = 0; //end of fat;
-      fssynch();
+      shadow = shadowbase > fatsize + 1; //unless the disk is too small for two copies
+      fat.format(fatsize+1, dataend()); //fat[0] = first data block, each block points to the next
+      level = true; //every page goes out at the first fssynch
    }
    else
    {
       istringstream instream;
       instream.str(buffer);
          //read in root
+      root.format(rootsize);
       for(int i = 0; i < rootsize; i++)
       {
          string file;
          int block;
          instream >> file >> block; //input file and block from stream
-         filename.push_back(file); //push back filename to filename vector
-         firstblock.push_back(block); //push back first block to firstblock vector
-      }
-      //read in fat
-      string ft; //string to hold all blocks of fat
-      for(int i = 1; i <= fatsize; i++) //get blocks 1 to fatsize
-      {
-         string f; //string to hold individual blocks temporarily
-         getblock(i, f); //get block i and store it into f
-         ft += f; //add f onto ft
-      }
-      istringstream fatstream;
-      fatstream.str(ft);
-      for(int i = 0; i < getnumberofblocks(); i++)
-      {   
-         int n = 0;
-         fatstream >> n; // input stream to integer n
-         fat.push_back(n); //push back n to fat
-      }   
+         if(file != "xxxxx")
+         {
+            root.set(i, file);
+         }
+         root.first(i) = block;
+      }
+      //a fixed width fat is paged in as it is used; older disks are
+      //read whole once and written back fixed width at the next fssynch
+      if(!fat.paged())
+      {
+         string ft; //string to hold all blocks of fat
+         for(int i = 1; i <= fatsize; i++) //get blocks 1 to fatsize
+         {
+            getblock(i, ft); //get block i and add it onto ft
+         }
+         fat.parse(ft);
+         paged = false;
+         level = true;
+      }
+      claim = !shadow && shadowbase > fatsize + 1;
    }//end else
+   //start with one group holding the whole free chain in its stored order
+   groupsize = dataend() - (fatsize + 1);
+   grouphead = vector<int>(1, fat[0]);
+   grouptail = vector<int>(1, 0);
+   groupfree = vector<int>(1, 0);
+   grouplock = vector<mutex>(1);
+   if(paged && fatsize >= 3)
+   {
+      groupfree[0] = fat[2]; //kept by fssynch so mount need not walk the chain
+      grouptail[0] = fat[3];
+   }
+   else
+   {
+      for(int b = fat[0]; b != 0; b = fat[b])
+      {
+         grouptail[0] = b;
+         groupfree[0]++;
+      }
+   }
+   if(claim)
+   {
+      //a disk from before the second copy gets one if the blocks it
+      //needs at the end are still free
+      vector<int> freelist;
+      int reserved = 0;
+      for(int b = fat[0]; b != 0; b = fat[b])
+      {
+         if(b >= shadowbase)
+         {
+            reserved++;
+         }
+         else
+         {
+            freelist.push_back(b);
+         }
+      }
+      claim = reserved == getnumberofblocks() - shadowbase;
+      if(claim)
+      {
+         setfree(freelist);
+         shadow = true;
+         groupsize = dataend() - (fatsize + 1);
+      }
+   }
+   fat.twocopies(shadow);
+   int k = findfile(inlinename);
+   if(k >= 0)
+   {
+      //"slot length payload" for every inline file
+      string packed;
+      for(int b = root.first(k); b != 0; b = fat[b])
+      {
+         getblock(b, packed);
+      }
+      istringstream instream(packed);
+      int slot;
+      int length;
+      while(instream >> slot >> length && instream.get() == ' ')
+      {
+         string data(length, '#');
+         if(!instream.read(&data[0], length))
+         {
+            break;
+         }
+         if(slot >= 0 && slot < rootsize)
+         {
+            inlinedata[slot] = data;
+         }
+      }
+   }
+   if(buffer[0] == '#' || claim)
+   {
+      fssynch(); //write the new file system out
+   }
+}
+Filesys::~Filesys()
+{
+   setflusher(0, 0); //whatever the flusher still holds goes to disk
 }
 int Filesys::fsclose()
 {
-   return fssynch();
+   fssynch();
+   return fsbarrier();
+}
+int Filesys::fsbarrier()
+{
+   lock_guard<mutex> sl(synclock);
+   barrier();
+   return 1;
+}
+void Filesys::barrier()
+{
+   //caller holds synclock; everything written so far is durable after
+   //this, the last superblock included, so what it freed may go
+   sync();
+   trimcommit();
+   release();
 }
 int Filesys::fssynch()
 {
-   //write root to disk
+   lock_guard<mutex> sl(synclock);
+   long long start = Histogram::now();
+   //with two copies the one not named by the superblock is rewritten,
+   //then the superblock is flipped to it in one block write
+   int target = shadow ? 1 - area : area;
+   int targetroot = target == 1 ? shadowbase : 0;
    string rootbuffer;
-   ostringstream rootstream;
-   for(int i = 0; i < rootsize; i++)
+   vector<int> fatblocknumbers;
+   vector<string> fatblocks;
+   vector<int> inlineblocks;
+   vector<string> inlinebuffers;
    {
-      rootstream << filename[i] << " " << firstblock[i] << " ";
+      //snapshot under an exclusive dirlock so no operation is half done
+      unique_lock<shared_mutex> dl(dirlock);
+      unsynced = 0;
+      if(inlinedirty.exchange(false))
+      {
+         packinline(inlineblocks, inlinebuffers);
+      }
+      ostringstream rootstream;
+      for(int i = 0; i < rootsize; i++)
+      {
+         rootstream << root.name(i) << " " << root.first(i) << " ";
+      }
+      rootbuffer = rootstream.str();
+      fat.flush(fatpatches(), targetroot + 1, fatblocknumbers, fatblocks); //only the pages that changed
+      {
+         //blocks freed before this snapshot are free in it; they can be
+         //reused once it is the commit on disk
+         lock_guard<mutex> ll(limbolock);
+         snapped.swap(limbo);
+         snapshots++; //blocks allocated from here on are in no commit yet
+      }
+      if(discarding())
+      {
+         //blocks still free at this snapshot may be punched once it is on disk
+         vector<int> gone;
+         lock_guard<mutex> fl(freedlock);
+         for(int i = 0; i < freedlist.size(); i++)
+         {
+            if(freed[freedlist[i]])
+            {
+               freed[freedlist[i]] = 0;
+               gone.push_back(freedlist[i]);
+            }
+         }
+         freedlist.clear();
+         discard(gone, shadow); //with two copies, not before the superblock is durable
+      }
    }
-   rootbuffer = rootstream.str();
+   putblocks(inlineblocks, inlinebuffers); //before the root that names them
+   //write root to disk
    vector<string> rootblock = block(rootbuffer, getblocksize()); //pads the end of rootblock
-   putblock(0,rootblock[0]); // write rootblock pieces to disk   
-   
+   putblock(targetroot,rootblock[0]); // write rootblock pieces to disk
+
    //write fat to disk
-   string fatbuffer;
-   ostringstream fatstream;
-   for(int i = 0; i < fat.size(); i++)
+   putblocks(fatblocknumbers, fatblocks);
+   if(shadow && !level)
+   {
+      //first commit since mount: the other copy may predate the last one,
+      //so every FAT block this flush left out is copied across
+      int from = (area == 1 ? shadowbase : 0) + 1;
+      vector<char> written(fatsize, 0);
+      for(int i = 0; i < fatblocknumbers.size(); i++)
+      {
+         written[fatblocknumbers[i] - (targetroot + 1)] = 1;
+      }
+      for(int i = 0; i < fatsize; )
+      {
+         vector<int> sources;
+         vector<int> targets;
+         for(; i < fatsize && sources.size() < 256; i++)
+         {
+            if(!written[i])
+            {
+               sources.push_back(from + i);
+               targets.push_back(targetroot + 1 + i);
+            }
+         }
+         vector<string> copies;
+         getblocks(sources, copies);
+         putblocks(targets, copies);
+      }
+      level = true;
+   }
+   if(shadow)
    {
-      fatstream << fat[i] << " "; // write fat pieces to outstream seperated by space
+      //the whole copy is down before the superblock names it; the last
+      //superblock is durable too, so what it freed may go
+      barrier();
+      generation++;
+      ostringstream superstream;
+      superstream << "shadow " << generation << " " << target << " " << getnumberofblocks() << " " << fatsize << " ";
+      putblock(getnumberofblocks() - 1, superstream.str()); //durable at the next barrier
+      area = target;
+      fat.relocate(targetroot + 1);
+      lock_guard<mutex> ll(limbolock);
+      committing.swap(snapped);
+      snapped.clear();
    }
-   fatbuffer = fatstream.str(); // string buffer holds outstream result
-   vector<string> fatblocks = block(fatbuffer, getblocksize()); //seperate buffer into blocksize pieces
-   for(int i = 0; i < fatblocks.size(); i++)
+   fat.written();
+   if(!shadow)
    {
-      putblock(i+1,fatblocks[i]); // write blocksize pieces to disk
+      barrier();
    }
+   synctime.add(Histogram::now() - start);
+   return 1;
 }
 int Filesys::newfile(string file)
 {
-   for(int i = 0; i < filename.size(); i++) //check if file exists
+   if(file == inlinename || file == "xxxxx")
+   {
+      cout << "File name is reserved" << endl;
+      return -1;
+   }
    {
-      if(filename[i] == file)
+      unique_lock<shared_mutex> dl(dirlock);
+      if(findfile(file) >= 0) //check if file exists
       {
          cout << "File already exists" << endl;
          return -1; //file already exists;
       }
-   }
-   for(int i = 0; i < filename.size(); i++) //check if there is free space ("xxxxx")
-   {
-      if(filename[i] == "xxxxx")
+      int i = root.freeslot(); //check if there is free space
+      if(i < 0)
       {
-         filename[i] = file; // replace free space with filename
-         firstblock[i] = 0; //firstblock is root
-         fssynch(); //sync with disk
-         return 1;
+         return -1; // no freespace
       }
+      root.set(i, file); // the free slot takes the filename
+      root.first(i) = 0; //firstblock is root
+      lastblock[i] = 0;
+      heat[i] = 0;
    }
-   return -1; // no freespace
+   changed(); //sync with disk
+   return 1;
 }
 int Filesys::rmfile(string file)
 {
-   for(int i = 0; i < filename.size(); i++) //check for file
    {
-      if(filename[i] == file) //if file exists
+      unique_lock<shared_mutex> dl(dirlock);
+      int i = findfile(file); //check for file
+      if(i < 0)
       {
-         if(firstblock[i] == 0) //if first block is 0, then no blocks attached to the file
-         {
-            filename[i] = "xxxxx";
-            fssynch(); //write to disk
-            return 1; //file removed
-         }
-         else
-         {
-            cout << "File cannot be deleted because file contains data" << endl;
-            return -1; //file contains blocks   
-         }
+         cout << "File does not exist" << endl;
+         return -1; //file does not exist
       }
-   }
-   cout << "File does not exist" << endl;
-   return -1; //file does not exist
-}
-int Filesys::getfirstblock(string file)
-{
-   for(int i = 0; i < filename.size(); i++)
-   {
-      if(filename[i] == file)
+      if(root.first(i) != 0) //if first block is 0, then no blocks attached to the file
       {
-         return firstblock[i];
+         cout << "File cannot be deleted because file contains data" << endl;
+         return -1; //file contains blocks
       }
+      root.free(i);
+      unload(i);
    }
-   return -1;   
+   changed(); //write to disk
+   return 1; //file removed
 }
-int Filesys::addblock(string file, string buffer)
+int Filesys::getfirstblock(string file)
 {
-   int block = getfirstblock(file);
-   
-   int allocate;
-   if(fat[0] == fat.size()-1)
+   shared_lock<shared_mutex> dl(dirlock);
+   int i = findfile(file);
+   if(i < 0)
    {
-      cout << "Disk is full" << endl;
       return -1;
    }
-
-   if(block == -1)
-   {
-      cout << "File does not exist" << endl;
-      return 0;
-   }   
-   else if(block == 0) //file has no blocks, add first block
+   shared_lock<shared_mutex> fl(filelock[i]);
+   return root.first(i);
+}
+int Filesys::addblock(string file, string_view buffer)
+{
+   reclaim(1);
    {
-      allocate = fat[0]; // allocate = 1st free space
-      fat[0] = fat[fat[0]]; // 1st free space is replaced with 2nd free space
-      fat[allocate] = 0; //old free space is now end of file (0)
-      for(int i = 0; i < filename.size(); i++)
+      shared_lock<shared_mutex> dl(dirlock);
+      int i = findfile(file);
+      if(i < 0)
       {
-         if(filename[i] == file)
-         {
-            firstblock[i] = allocate; //set first block of the file equal to allocate
-         }      
+         cout << "File does not exist" << endl;
+         return 0;
       }
-   }
-   else
-   {   
-      allocate = fat[0]; // allocate = 1st free space
-      fat[0] = fat[fat[0]]; // 1st free space is replaced with 2nd free space
-      fat[allocate] = 0; //old free space is now end of file (0)
-      while(fat[block] != 0)
+      unique_lock<shared_mutex> fl(filelock[i]);
+      if(root.first(i) == 0 && fitsinline(buffer))
       {
-         block = fat[block]; //go through each block of the file until you reach the end of file
+         inlinedata[i].assign(payload(buffer));
+         root.first(i) = getnumberofblocks() + i;
+         lastblock[i] = root.first(i);
+         inlinedirty = true;
+         fl.unlock();
+         dl.unlock();
+         changed();
+         return 1;
+      }
+      if(isinline(i) && outline(i) == 0)
+      {
+         cout << "Disk is full" << endl;
+         return -1;
+      }
+      int allocate = allocblock(i);
+      if(allocate == 0)
+      {
+         cout << "Disk is full" << endl;
+         return -1;
+      }
+      //data goes down before the block is linked so no reader sees stale bytes
+      putblock(allocate,buffer); //write the block onto the disk
+      int block = tailof(i); //end of file
+      if(block == 0) //file has no blocks, add first block
+      {
+         root.first(i) = allocate; //set first block of the file equal to allocate
+      }
+      else
+      {
+         fat[block] = allocate; //that space that had the end of file now points allocate
+      }
+      lastblock[i] = allocate;
+      if(pinned[i])
+      {
+         pinblock(i, allocate, buffer);
       }
-      fat[block] = allocate; //that space that had the end of file now points allocate
    }
-   fssynch(); //sync file system
-   putblock(allocate,buffer); //write the block onto the disk
+   changed(); //sync file system
    return 1; //succcess
 }
 int Filesys::delblock(string file, int blocknumber)
 {
-   int block = getfirstblock(file);
-
-   if(block <= 0)
-   { //either file doesn't exist, or file contains no blocks
-      cout << "No blocks associated with the filename" << endl;
-      return 0;
-   }
-   else if(block == blocknumber)//we're deleting first block of the file
    {
-      for(int i = 0; i < filename.size(); i++)
+      shared_lock<shared_mutex> dl(dirlock);
+      int i = findfile(file);
+      if(i < 0)
+      {
+         cout << "No blocks associated with the filename" << endl;
+         return 0;
+      }
+      unique_lock<shared_mutex> fl(filelock[i]);
+      int block = root.first(i);
+      if(block <= 0)
+      { //either file doesn't exist, or file contains no blocks
+         cout << "No blocks associated with the filename" << endl;
+         return 0;
+      }
+      else if(isinline(i))
       {
-         if(filename[i] == file)
+         if(block != blocknumber)
          {
-            firstblock[i] = fat[block]; //first block of the file is now the 2nd block
+            cout << "Error in deleting block. Block does not belong to the file" << endl;
+            return 0;
          }
+         root.first(i) = 0; //nothing to free, the payload just goes
+         lastblock[i] = 0;
+         inlinedata[i].clear();
+         inlinedirty = true;
+         fl.unlock();
+         dl.unlock();
+         changed();
+         return 1;
       }
-   }
-   else //we're deleting some other block
-   {   
-      while(fat[block] != blocknumber && fat[block] != 0) //go through every block of the file until you hit
-      {                         // the block that points to the block you want to delete
-         block = fat[block]; 
+      else if(block == blocknumber)//we're deleting first block of the file
+      {
+         root.first(i) = fat[block]; //first block of the file is now the 2nd block
+      }
+      else //we're deleting some other block
+      {
+         int steps = 0;
+         while(fat[block] != blocknumber && fat[block] != 0) //go through every block of the file until you hit
+         {                         // the block that points to the block you want to delete
+            block = fat[block];
+            steps++;
+         }
+         chainsteps.add(steps);
+         if(fat[block] != 0) // fat[blocknumber] = next block after the block
+         {
+            fat[block] = fat[blocknumber]; //skip the chain
+         }
+         else //you hit the end of file
+         {
+            cout << "Error in deleting block. Block does not belong to the file" << endl;
+            return 0;
+         }
       }
-      if(fat[block] != 0) // fat[blocknumber] = next block after the block
+      if(lastblock[i] == blocknumber)
       {
-         fat[block] = fat[blocknumber]; //skip the chain 
+         lastblock[i] = 0; //tail moved, find it again on the next append
       }
-      else //you hit the end of file
+      if(pinned[i])
       {
-         cout << "Error in deleting block. Block does not belong to the file" << endl;
-         return 0;
+         pinnedblocks -= pindata[i].erase(blocknumber);
       }
+      freeblock(blocknumber);
    }
-   
-   fat[blocknumber] = fat[0]; //blocknumber now points to 1st freespace
-   fat[0] = blocknumber; //1st free space is now the block that was deleted
-   fssynch();
+   changed();
    return 1; // success
 }
 int Filesys::readblock(string file, int blocknumber, string& buffer)
 {
-   if(checkblock(file,blocknumber) == false)
+   size_t start = buffer.size();
+   buffer.resize(start + getblocksize()); //block is appended to buffer
+   int result = readblock(file, blocknumber, &buffer[start]);
+   if(result == 0)
    {
-      return 0;
+      buffer.resize(start);
    }
-   getblock(blocknumber,buffer);
-   return 1;
+   return result;
 }
-int Filesys::writeblock(string file, int blocknumber, string buffer)
+static int fetchblock(Filesys& fsys, int blocknumber, char* buffer)
 {
-   if(checkblock(file,blocknumber) == false)
+   return fsys.getblock(blocknumber, buffer);
+}
+static int storeblock(Filesys& fsys, int blocknumber, string_view buffer)
+{
+   return fsys.putblock(blocknumber, buffer); //putblock pads it out
+}
+int Filesys::readblock(string file, int blocknumber, char* buffer)
+{
+   return readthrough(file, blocknumber, buffer, fetchblock);
+}
+int Filesys::readthrough(string file, int blocknumber, char* buffer, Fetch fetch)
+{
+   int result = 0;
+   bool promoting = false;
    {
-      return -1;
+      shared_lock<shared_mutex> dl(dirlock);
+      int i = findfile(file);
+      if(i < 0)
+      {
+         return 0;
+      }
+      shared_lock<shared_mutex> fl(filelock[i]);
+      auto hit = pinned[i] ? pindata[i].find(blocknumber) : pindata[i].end();
+      if(pinlimit > 0)
+      {
+         heatup(i);
+         promoting = pinned[i] == 0 && heat[i] >= pinthreshold;
+      }
+      if(hit != pindata[i].end())
+      {
+         //no chain walk and no disk I/O
+         pinhits.add(1);
+         hit->second.copy(buffer, getblocksize());
+         result = 1;
+      }
+      else if(checkblock(file,blocknumber) == false)
+      {
+         result = 0;
+      }
+      else if(isinline(i))
+      {
+         //no disk I/O at all
+         inlinehits.add(1);
+         int size = inlinedata[i].copy(buffer, inlinedata[i].size());
+         fill(buffer + size, buffer + getblocksize(), '#');
+         result = 1;
+      }
+      else
+      {
+         result = fetch(*this, blocknumber, buffer);
+      }
    }
-   if(buffer.length() > getblocksize())
+   if(promoting)
    {
-      cout << "Error. Too large to write to a single block" << endl;
-      return -1;
+      promote(file);
+   }
+   fatspill();
+   return result;
+}
+int Filesys::writeblock(string file, int blocknumber, string_view buffer)
+{
+   return writethrough(file, blocknumber, buffer, storeblock);
+}
+int Filesys::writethrough(string file, int blocknumber, string_view buffer, Store store)
+{
+   {
+      shared_lock<shared_mutex> dl(dirlock);
+      int i = findfile(file);
+      if(i < 0)
+      {
+         return -1;
+      }
+      unique_lock<shared_mutex> fl(filelock[i]);
+      if(checkblock(file,blocknumber) == false)
+      {
+         return -1;
+      }
+      if(buffer.length() > getblocksize())
+      {
+         cout << "Error. Too large to write to a single block" << endl;
+         return -1;
+      }
+      if(!isinline(i))
+      {
+         store(*this, blocknumber, buffer);
+         if(pinned[i])
+         {
+            pinblock(i, blocknumber, buffer); //write-through
+         }
+         return 1;
+      }
+      if(fitsinline(buffer))
+      {
+         inlinedata[i].assign(payload(buffer));
+      }
+      else
+      {
+         //outgrew the directory; the file now starts at a real block
+         int allocate = outline(i);
+         if(allocate == 0)
+         {
+            cout << "Disk is full" << endl;
+            return -1;
+         }
+         putblock(allocate,buffer);
+      }
+      inlinedirty = true;
    }
-   vector<string> buffers = block(buffer, getblocksize());
-   putblock(blocknumber,buffers[0]);
+   changed();
    return 1;
 }
 int Filesys::nextblock(string file, int blocknumber)
 {
-   if(checkblock(file,blocknumber) == false)
+   int result = -1;
    {
-      return -1;
+      shared_lock<shared_mutex> dl(dirlock);
+      int i = findfile(file);
+      if(i < 0)
+      {
+         return -1;
+      }
+      shared_lock<shared_mutex> fl(filelock[i]);
+      if(pinned[i] && pindata[i].count(blocknumber) > 0)
+      {
+         result = fat[blocknumber]; //pinned blocks are known to be in the file
+      }
+      else if(checkblock(file,blocknumber) == false)
+      {
+         result = -1;
+      }
+      else if(isinline(i))
+      {
+         result = 0; //an inline file is its only block
+      }
+      else
+      {
+         result = fat[blocknumber];
+      }
    }
-   return fat[blocknumber];
-   
+   fatspill();
+   return result;
 }
 bool Filesys::checkblock(string file, int blocknumber)
 {
-   int block = getfirstblock(file); //return the first block of file
-   if(getfirstblock(file) == blocknumber)
+   int i = findfile(file);
+   if(i < 0)
+   {
+      return false;
+   }
+   int block = root.first(i); //the first block of file
+   if(block == blocknumber)
+   {
+      return true;
+   }
+   if(block == 0 || block >= getnumberofblocks()) //empty or inline, don't wander onto the free chain
    {
-      return true;   
+      cout << "Blocknumber does not belong to the file" << endl;
+      return false;
    }
+   int steps = 0;
    while(fat[block] != blocknumber && fat[block] != 0) //go through every block of the file until you hit
    {                         // the block that points to the block of interest
-      block = fat[block]; 
+      block = fat[block];
+      steps++;
    }
+   chainsteps.add(steps);
    if(fat[block] != 0) // fat[blocknumber] = next block after the block
    {
       return true;
@@ -324,3 +793,952 @@ bool Filesys::checkblock(string file, int blocknumber)
       return false;
    }
 }
+int Filesys::findfile(string file)
+{
+   dirscans.add(1);
+   int probes;
+   int i = root.find(file, probes);
+   dirprobes.add(probes);
+   return i;
+}
+vector<string> Filesys::ls()
+{
+   shared_lock<shared_mutex> dl(dirlock);
+   vector<string> names(rootsize);
+   for(int i = 0; i < rootsize; i++)
+   {
+      names[i] = root.name(i);
+   }
+   int k = findfile(inlinename);
+   if(k >= 0)
+   {
+      names[k] = "xxxxx"; //not a user file
+   }
+   return names;
+}
+int Filesys::addblocks(string file, const vector<string>& blocks)
+{
+   vector<string_view> views(blocks.begin(), blocks.end());
+   return addblocks(file, views);
+}
+int Filesys::addblocks(string file, const vector<string_view>& blocks)
+{
+   reclaim(blocks.size());
+   vector<int> allocated;
+   {
+      shared_lock<shared_mutex> dl(dirlock);
+      int i = findfile(file);
+      if(i < 0)
+      {
+         cout << "File does not exist" << endl;
+         return -1;
+      }
+      unique_lock<shared_mutex> fl(filelock[i]);
+      if(root.first(i) == 0 && blocks.size() == 1 && fitsinline(blocks[0]))
+      {
+         inlinedata[i].assign(payload(blocks[0]));
+         root.first(i) = getnumberofblocks() + i;
+         lastblock[i] = root.first(i);
+         inlinedirty = true;
+         fl.unlock();
+         dl.unlock();
+         changed();
+         return 1;
+      }
+      if(isinline(i) && outline(i) == 0)
+      {
+         cout << "Disk is full" << endl;
+         return 0;
+      }
+      allocated.reserve(blocks.size());
+      for(int j = 0; j < blocks.size(); j++)
+      {
+         int allocate = allocblock(i);
+         if(allocate == 0)
+         {
+            cout << "Disk is full" << endl;
+            break;
+         }
+         fat[allocate] = 0;
+         if(allocated.size() > 0)
+         {
+            fat[allocated.back()] = allocate; //chain the new blocks to each other
+         }
+         allocated.push_back(allocate);
+      }
+      if(allocated.size() == 0)
+      {
+         return 0;
+      }
+      //all data goes down in one batch before the chain is linked to the file
+      vector<string_view> data(blocks.begin(), blocks.begin() + allocated.size());
+      putblocks(allocated, data);
+      int block = tailof(i);
+      if(block == 0)
+      {
+         root.first(i) = allocated[0];
+      }
+      else
+      {
+         fat[block] = allocated[0];
+      }
+      lastblock[i] = allocated.back();
+      for(int j = 0; pinned[i] && j < allocated.size(); j++)
+      {
+         pinblock(i, allocated[j], blocks[j]);
+      }
+   }
+   changed();
+   return allocated.size();
+}
+int Filesys::readblocks(string file, int blocknumber, int count, vector<string>& buffers)
+{
+   //reads up to count blocks of the chain starting at blocknumber and
+   //returns the block after them (0 at end of file, -1 on error)
+   int block = -1;
+   bool promoting = false;
+   {
+      shared_lock<shared_mutex> dl(dirlock);
+      int i = findfile(file);
+      if(i < 0)
+      {
+         return -1;
+      }
+      shared_lock<shared_mutex> fl(filelock[i]);
+      bool known = pinned[i] && pindata[i].count(blocknumber) > 0;
+      if(!known && checkblock(file,blocknumber) == false)
+      {
+         return -1;
+      }
+      if(pinlimit > 0)
+      {
+         heatup(i);
+         promoting = pinned[i] == 0 && heat[i] >= pinthreshold;
+      }
+      if(isinline(i))
+      {
+         buffers = vector<string>(1);
+         buffers[0] = inlinedata[i];
+         inlinehits.add(1);
+         buffers[0].append(getblocksize() - inlinedata[i].size(), '#');
+         return 0;
+      }
+      vector<int> numbers;
+      numbers.reserve(count);
+      block = blocknumber;
+      while(block != 0 && numbers.size() < count)
+      {
+         numbers.push_back(block);
+         block = fat[block];
+      }
+      chainsteps.add(numbers.size());
+      bool served = known;
+      if(known)
+      {
+         buffers.resize(numbers.size());
+         for(int k = 0; served && k < numbers.size(); k++)
+         {
+            auto hit = pindata[i].find(numbers[k]);
+            served = hit != pindata[i].end();
+            if(served)
+            {
+               buffers[k] = hit->second;
+            }
+         }
+      }
+      if(served)
+      {
+         pinhits.add(numbers.size());
+      }
+      else if(getblocks(numbers, buffers) == 0)
+      {
+         block = -1;
+      }
+   }
+   if(promoting)
+   {
+      promote(file);
+   }
+   fatspill();
+   return block;
+}
+int Filesys::mapfile(string file, Fileview& view)
+{
+   view.close();
+   shared_lock<shared_mutex> dl(dirlock);
+   int i = findfile(file);
+   if(i < 0)
+   {
+      cout << "File does not exist" << endl;
+      return 0;
+   }
+   shared_lock<shared_mutex> fl(filelock[i]);
+   vector<int> numbers;
+   bool inorder = true; //each block follows the one before it on disk
+   for(int b = root.first(i); b > 0 && b < getnumberofblocks(); b = fat[b])
+   {
+      inorder = inorder && (numbers.empty() || b == numbers.back() + 1);
+      numbers.push_back(b);
+   }
+   chainsteps.add(numbers.size());
+   size_t bytes = (size_t)getblocksize() * (isinline(i) ? 1 : numbers.size());
+   if(bytes == 0)
+   {
+      return 1; //an empty file is an empty view
+   }
+   if(inorder && !isinline(i))
+   {
+      view.start = map(numbers[0], numbers.size(), view.base, view.length);
+      if(view.start != NULL)
+      {
+         view.bytes = bytes;
+         view.direct = true;
+         mapsinplace.add(1);
+         return 1;
+      }
+   }
+   //one anonymous mapping, filled in one batch and then made read-only
+   void* base = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if(base == MAP_FAILED)
+   {
+      cout << "Cannot map " << file << endl;
+      return 0;
+   }
+   char* at = (char*)base;
+   int ok = 1;
+   if(isinline(i))
+   {
+      inlinehits.add(1);
+      memcpy(at, inlinedata[i].data(), inlinedata[i].size());
+      memset(at + inlinedata[i].size(), '#', bytes - inlinedata[i].size());
+   }
+   else if(pinned[i])
+   {
+      for(int k = 0; k < numbers.size(); k++)
+      {
+         auto hit = pindata[i].find(numbers[k]);
+         if(hit != pindata[i].end())
+         {
+            memcpy(at + (size_t)k * getblocksize(), hit->second.data(), getblocksize());
+         }
+         else
+         {
+            ok &= getblock(numbers[k], at + (size_t)k * getblocksize());
+         }
+      }
+   }
+   else
+   {
+      ok = getblocks(numbers, at);
+   }
+   if(ok == 0)
+   {
+      munmap(base, bytes);
+      cout << "Cannot read " << file << endl;
+      return 0;
+   }
+   mprotect(base, bytes, PROT_READ);
+   view.base = base;
+   view.length = bytes;
+   view.start = at;
+   view.bytes = bytes;
+   view.direct = false;
+   mapsgathered.add(1);
+   return 1;
+}
+int Filesys::startbatch()
+{
+   return ++batchdepth;
+}
+int Filesys::endbatch()
+{
+   //never below zero, or a racing startbatch would see no batch open
+   int depth = batchdepth;
+   do
+   {
+      if(depth <= 0)
+      {
+         cout << "No batch to end" << endl;
+         return 0;
+      }
+   } while(!batchdepth.compare_exchange_weak(depth, depth - 1));
+   if(depth == 1 && dirty.exchange(false))
+   {
+      changed();
+   }
+   return 1;
+}
+void Filesys::changed()
+{
+   if(batchdepth > 0)
+   {
+      dirty = true;
+      if(batchdepth > 0 || dirty.exchange(false) == false)
+      {
+         return; //still batching, or a closing endbatch already synced
+      }
+   }
+   if(flushing)
+   {
+      if(++unsynced >= flushthreshold)
+      {
+         flushwake.notify_one();
+      }
+      return;
+   }
+   fssynch();
+}
+string Filesys::stats(bool json)
+{
+   ostringstream out;
+   if(json)
+   {
+      out << "{\"disk\":" << Sdisk::stats(true) << ",\"fssynch_ns\":" << synctime.json()
+          << ",\"chain_steps\":" << chainsteps.value()
+          << ",\"dir_scans\":" << dirscans.value() << ",\"dir_probes\":" << dirprobes.value()
+          << ",\"tail_hits\":" << tailhits.value() << ",\"tail_walks\":" << tailwalks.value()
+          << ",\"inline_hits\":" << inlinehits.value()
+          << ",\"pin_hits\":" << pinhits.value() << ",\"pinned_blocks\":" << pinnedblocks
+          << ",\"maps_in_place\":" << mapsinplace.value() << ",\"maps_gathered\":" << mapsgathered.value()
+          << ",\"fat_faults\":" << fat.faults() << ",\"fat_pages\":" << fat.resident() << "}";
+   }
+   else
+   {
+      out << Sdisk::stats(false)
+          << "fssynch          " << synctime.text() << endl
+          << "chain steps      " << chainsteps.value() << endl
+          << "directory scans  " << dirscans.value() << " (" << dirprobes.value() << " entries compared)" << endl
+          << "tail cache       " << tailhits.value() << " hits, " << tailwalks.value() << " walks" << endl
+          << "inline reads     " << inlinehits.value() << endl
+          << "pinned reads     " << pinhits.value() << " (" << pinnedblocks << " blocks pinned)" << endl
+          << "mapped files     " << mapsinplace.value() << " in place, " << mapsgathered.value() << " gathered" << endl
+          << "FAT pages        " << fat.resident() << " resident, " << fat.faults() << " faults" << endl;
+   }
+   return out.str();
+}
+void Filesys::resetstats()
+{
+   Sdisk::resetstats();
+   synctime.reset();
+   chainsteps.reset();
+   dirscans.reset();
+   dirprobes.reset();
+   tailhits.reset();
+   tailwalks.reset();
+   inlinehits.reset();
+   pinhits.reset();
+   mapsinplace.reset();
+   mapsgathered.reset();
+   fat.resetfaults();
+}
+int Filesys::setflusher(int milliseconds, int threshold)
+{
+   if(flushing)
+   {
+      {
+         lock_guard<mutex> fl(flushlock);
+         flushstop = true;
+      }
+      flushwake.notify_all();
+      flusher.join(); //syncs anything still waiting on its way out
+      flushing = false;
+   }
+   if(milliseconds > 0)
+   {
+      flushinterval = milliseconds;
+      flushthreshold = threshold > 0 ? threshold : 1;
+      flushstop = false;
+      flushing = true;
+      flusher = thread(&Filesys::flushloop, this);
+   }
+   return 1;
+}
+void Filesys::flushloop()
+{
+   unique_lock<mutex> fl(flushlock);
+   while(true)
+   {
+      flushwake.wait_for(fl, chrono::milliseconds(flushinterval),
+                         [this]() { return flushstop || unsynced >= flushthreshold; });
+      bool stop = flushstop;
+      if(unsynced > 0)
+      {
+         fl.unlock(); //changed() must not wait behind a commit
+         fssynch();
+         fl.lock();
+      }
+      if(stop)
+      {
+         fsbarrier();
+         break;
+      }
+   }
+}
+int Filesys::tailof(int slot)
+{
+   if(lastblock[slot] == 0 && root.first(slot) != 0)
+   {
+      int block = root.first(slot);
+      int steps = 0;
+      while(fat[block] != 0)
+      {
+         block = fat[block]; //go through each block of the file until you reach the end of file
+         steps++;
+      }
+      lastblock[slot] = block;
+      chainsteps.add(steps);
+      tailwalks.add(1);
+   }
+   else
+   {
+      tailhits.add(1);
+   }
+   return lastblock[slot];
+}
+int Filesys::allocgroups(int groups)
+{
+   {
+      unique_lock<shared_mutex> dl(dirlock);
+      int datablocks = dataend() - (fatsize + 1);
+      if(groups < 1)
+      {
+         groups = 1;
+      }
+      if(groups > datablocks)
+      {
+         groups = datablocks;
+      }
+      //gather the free blocks in their current order, then deal them out
+      vector<int> freelist;
+      for(int g = 0; g < grouphead.size(); g++)
+      {
+         for(int b = grouphead[g]; b != 0; b = fat[b])
+         {
+            freelist.push_back(b);
+         }
+      }
+      groupsize = (datablocks + groups - 1) / groups;
+      grouplock = vector<mutex>(groups);
+      setfree(freelist);
+   }
+   changed();
+   return groups;
+}
+void Filesys::setfree(const vector<int>& freelist)
+{
+   //rebuilds every group chain from freelist, keeping its order within
+   //each group; caller holds dirlock exclusively. With two copies, blocks
+   //that were not free already wait in limbo for the next commit.
+   vector<char> wasfree;
+   if(shadow)
+   {
+      wasfree = vector<char>(getnumberofblocks(), 0);
+      for(int g = 0; g < grouphead.size(); g++)
+      {
+         for(int b = grouphead[g]; b != 0; b = fat[b])
+         {
+            wasfree[b] = 1;
+         }
+      }
+   }
+   int groups = grouplock.size();
+   grouphead = vector<int>(groups, 0);
+   grouptail = vector<int>(groups, 0);
+   groupfree = vector<int>(groups, 0);
+   for(int i = 0; i < freelist.size(); i++)
+   {
+      int b = freelist[i];
+      if(shadow && !wasfree[b])
+      {
+         if(!inlimbo[b])
+         {
+            fat[b] = 0;
+            inlimbo[b] = 1;
+            limbo.push_back(b);
+         }
+         continue;
+      }
+      int g = groupof(b);
+      fat[b] = 0;
+      if(grouphead[g] == 0)
+      {
+         grouphead[g] = b;
+      }
+      else
+      {
+         fat[grouptail[g]] = b; //append so each group keeps the old order
+      }
+      grouptail[g] = b;
+      groupfree[g]++;
+      if(discarding() && !freed[b])
+      {
+         freed[b] = 1;
+         freedlist.push_back(b);
+      }
+   }
+}
+int Filesys::freeblocks()
+{
+   shared_lock<shared_mutex> dl(dirlock);
+   int total = 0;
+   for(int g = 0; g < grouplock.size(); g++)
+   {
+      lock_guard<mutex> gl(grouplock[g]);
+      total += groupfree[g];
+   }
+   return total;
+}
+int Filesys::allocblock(int slot)
+{
+   //each file starts in its own group; a dry group steals from its
+   //nearest neighbour, alternating right and left
+   int groups = grouphead.size();
+   int home = slot % groups;
+   for(int step = 0; step < 2 * groups; step++)
+   {
+      int g = home + (step % 2 == 0 ? step / 2 : -(step / 2 + 1));
+      if(g < 0 || g >= groups)
+      {
+         continue;
+      }
+      lock_guard<mutex> gl(grouplock[g]);
+      int allocate = grouphead[g]; // allocate = 1st free space
+      if(allocate == 0)
+      {
+         continue; //group is dry
+      }
+      grouphead[g] = fat[allocate]; // 1st free space is replaced with 2nd free space
+      if(grouphead[g] == 0)
+      {
+         grouptail[g] = 0;
+      }
+      groupfree[g]--;
+      fat[allocate] = 0; //old free space is now end of file (0)
+      freed[allocate] = 0; //in use again, don't punch it
+      bornin[allocate] = snapshots;
+      return allocate;
+   }
+   return 0; //every group is empty
+}
+void Filesys::freeblock(int blocknumber)
+{
+   int g = groupof(blocknumber);
+   if(shadow && bornin[blocknumber] != snapshots)
+   {
+      //the last commit may still use it; reusable after the next one
+      fat[blocknumber] = 0;
+      lock_guard<mutex> ll(limbolock);
+      inlimbo[blocknumber] = 1;
+      limbo.push_back(blocknumber);
+   }
+   else
+   {
+      lock_guard<mutex> gl(grouplock[g]);
+      fat[blocknumber] = grouphead[g]; //blocknumber now points to 1st freespace
+      if(grouphead[g] == 0)
+      {
+         grouptail[g] = blocknumber;
+      }
+      grouphead[g] = blocknumber; //1st free space is now the block that was deleted
+      groupfree[g]++;
+   }
+   lock_guard<mutex> gl(grouplock[g]);
+   if(discarding() && !freed[blocknumber])
+   {
+      freed[blocknumber] = 1;
+      lock_guard<mutex> fl(freedlock);
+      freedlist.push_back(blocknumber);
+   }
+}
+int Filesys::groupof(int blocknumber)
+{
+   int g = (blocknumber - (fatsize + 1)) / groupsize;
+   if(g >= grouphead.size())
+   {
+      g = grouphead.size() - 1;
+   }
+   return g;
+}
+vector<int> Filesys::fatimage()
+{
+   //caller holds dirlock exclusively
+   vector<int> image(fat.size());
+   for(int i = 0; i < image.size(); i++)
+   {
+      image[i] = fat[i];
+   }
+   vector<pair<int,int> > patches = fatpatches();
+   for(int i = 0; i < patches.size(); i++)
+   {
+      image[patches[i].first] = patches[i].second;
+   }
+   return image;
+}
+vector<pair<int,int> > Filesys::fatpatches()
+{
+   //the disk format has a single free chain from fat[0], so the group
+   //chains are joined tail to head, and blocks in limbo after them.
+   //fat[1] marks the fixed width format with its width, and fat[2] and
+   //fat[3] keep the free count and the chain's tail when they are FAT
+   //blocks too.
+   vector<pair<int,int> > patches;
+   int last = 0;
+   int total = 0;
+   for(int g = 0; g < grouphead.size(); g++)
+   {
+      total += groupfree[g];
+      if(grouphead[g] != 0)
+      {
+         patches.push_back(make_pair(last, grouphead[g]));
+         last = grouptail[g];
+      }
+   }
+   vector<int> waiting = committing;
+   waiting.insert(waiting.end(), limbo.begin(), limbo.end());
+   for(int i = 0; i < waiting.size(); i++)
+   {
+      fat[waiting[i]] = i + 1 < waiting.size() ? waiting[i + 1] : 0;
+   }
+   if(waiting.size() > 0)
+   {
+      patches.push_back(make_pair(last, waiting[0]));
+      last = waiting.back();
+      total += waiting.size();
+   }
+   if(last != 0)
+   {
+      patches.push_back(make_pair(last, 0));
+   }
+   else
+   {
+      patches.push_back(make_pair(0, 0)); //no free blocks
+   }
+   patches.push_back(make_pair(1, fatwidth(getnumberofblocks())));
+   if(fatsize >= 3)
+   {
+      patches.push_back(make_pair(2, total));
+      patches.push_back(make_pair(3, last));
+   }
+   return patches;
+}
+int Filesys::setinline(int bytes)
+{
+   {
+      unique_lock<shared_mutex> dl(dirlock);
+      if(bytes > 0 && findfile(inlinename) < 0)
+      {
+         int k = root.freeslot(); //the payloads need a chain of their own
+         if(k < 0)
+         {
+            cout << "No directory slot for inline files" << endl;
+            return -1;
+         }
+         root.set(k, inlinename);
+         root.first(k) = 0;
+         lastblock[k] = 0;
+      }
+      inlinelimit = bytes < getblocksize() ? bytes : getblocksize();
+   }
+   changed();
+   return 1;
+}
+bool Filesys::isinline(int slot)
+{
+   return root.first(slot) == getnumberofblocks() + slot;
+}
+bool Filesys::fitsinline(string_view buffer)
+{
+   return inlinelimit > 0 && buffer.size() <= getblocksize() && payload(buffer).size() <= inlinelimit;
+}
+int Filesys::outline(int slot)
+{
+   int allocate = allocblock(slot);
+   if(allocate == 0)
+   {
+      return 0;
+   }
+   putblock(allocate, inlinedata[slot]); //putblock pads it back out
+   if(pinned[slot])
+   {
+      pinblock(slot, allocate, inlinedata[slot]);
+   }
+   root.first(slot) = allocate;
+   lastblock[slot] = allocate;
+   inlinedata[slot].clear();
+   inlinedirty = true;
+   return allocate;
+}
+void Filesys::packinline(vector<int>& blocks, vector<string>& buffers)
+{
+   //writes every payload to a fresh .inline chain and frees the old one;
+   //the new chain is allocated first so a full disk keeps the old one
+   int k = findfile(inlinename);
+   if(k < 0)
+   {
+      return;
+   }
+   ostringstream packed;
+   for(int i = 0; i < rootsize; i++)
+   {
+      if(root.used(i) && isinline(i))
+      {
+         packed << i << " " << inlinedata[i].size() << " " << inlinedata[i];
+      }
+   }
+   if(packed.str().size() > 0)
+   {
+      buffers = block(packed.str(), getblocksize());
+   }
+   for(int j = 0; j < buffers.size(); j++)
+   {
+      int allocate = allocblock(k);
+      if(allocate == 0)
+      {
+         cout << "Disk is full" << endl;
+         for(int b = 0; b < blocks.size(); b++)
+         {
+            freeblock(blocks[b]);
+         }
+         blocks.clear();
+         buffers.clear();
+         inlinedirty = true; //try again on the next fssynch
+         return;
+      }
+      if(blocks.size() > 0)
+      {
+         fat[blocks.back()] = allocate;
+      }
+      blocks.push_back(allocate);
+   }
+   int b = root.first(k);
+   while(b != 0)
+   {
+      int next = fat[b];
+      freeblock(b);
+      b = next;
+   }
+   root.first(k) = blocks.size() > 0 ? blocks[0] : 0;
+   lastblock[k] = 0;
+}
+int Filesys::pin(string file)
+{
+   lock_guard<mutex> pl(pinlock);
+   shared_lock<shared_mutex> dl(dirlock);
+   int i = findfile(file);
+   if(i < 0)
+   {
+      cout << "File does not exist" << endl;
+      return 0;
+   }
+   unique_lock<shared_mutex> fl(filelock[i]);
+   if(pinned[i] == 0 && load(i) == 0)
+   {
+      cout << "Cannot read " << file << endl;
+      return 0;
+   }
+   pinned[i] = 1; //a promoted file stays now whatever its heat
+   return 1;
+}
+int Filesys::unpin(string file)
+{
+   lock_guard<mutex> pl(pinlock);
+   shared_lock<shared_mutex> dl(dirlock);
+   int i = findfile(file);
+   if(i < 0)
+   {
+      cout << "File does not exist" << endl;
+      return 0;
+   }
+   unique_lock<shared_mutex> fl(filelock[i]);
+   unload(i);
+   return 1;
+}
+int Filesys::setpinning(int blocks, int threshold)
+{
+   lock_guard<mutex> pl(pinlock);
+   pinlimit = blocks > 0 ? blocks : 0;
+   pinthreshold = threshold > 0 ? threshold : 1;
+   shared_lock<shared_mutex> dl(dirlock);
+   //promoted files past the new budget go, coldest first
+   int victim = coldest();
+   while(pinnedblocks > pinlimit && victim >= 0)
+   {
+      unique_lock<shared_mutex> vl(filelock[victim]);
+      unload(victim);
+      vl.unlock();
+      victim = coldest();
+   }
+   return 1;
+}
+void Filesys::heatup(int slot)
+{
+   heat[slot]++;
+   if(++pinreads >= pinage)
+   {
+      pinreads = 0;
+      for(int s = 0; s < rootsize; s++)
+      {
+         heat[s] = heat[s] / 2;
+      }
+   }
+}
+void Filesys::promote(string file)
+{
+   //room is made by unloading promoted files colder than this one; when
+   //there is not enough of them the file's count starts over instead
+   lock_guard<mutex> pl(pinlock);
+   shared_lock<shared_mutex> dl(dirlock);
+   int i = findfile(file);
+   if(i < 0 || pinned[i] != 0 || pinlimit == 0)
+   {
+      return;
+   }
+   int size = 0;
+   {
+      shared_lock<shared_mutex> fl(filelock[i]);
+      for(int b = root.first(i); b > 0 && b < getnumberofblocks(); b = fat[b])
+      {
+         size++;
+      }
+      chainsteps.add(size);
+   }
+   int room = pinlimit - pinnedblocks;
+   for(int s = 0; s < rootsize && room < size; s++)
+   {
+      if(pinned[s] == 2 && heat[s] < heat[i])
+      {
+         shared_lock<shared_mutex> sl(filelock[s]);
+         room += pindata[s].size();
+      }
+   }
+   if(size == 0 || room < size)
+   {
+      heat[i] = 0; //inline, empty, or hotter files fill the budget
+      return;
+   }
+   while(pinnedblocks + size > pinlimit)
+   {
+      int victim = coldest();
+      if(victim < 0)
+      {
+         heat[i] = 0; //pinned files grew in the meantime
+         return;
+      }
+      unique_lock<shared_mutex> vl(filelock[victim]);
+      unload(victim);
+   }
+   unique_lock<shared_mutex> fl(filelock[i]);
+   if(load(i) == 1)
+   {
+      pinned[i] = 2;
+   }
+   else
+   {
+      unload(i);
+   }
+}
+int Filesys::coldest()
+{
+   int victim = -1;
+   for(int s = 0; s < rootsize; s++)
+   {
+      if(pinned[s] == 2 && (victim < 0 || heat[s] < heat[victim]))
+      {
+         victim = s;
+      }
+   }
+   return victim;
+}
+int Filesys::load(int slot)
+{
+   //the whole chain in one batch
+   vector<int> numbers;
+   for(int b = root.first(slot); b > 0 && b < getnumberofblocks(); b = fat[b])
+   {
+      numbers.push_back(b);
+   }
+   chainsteps.add(numbers.size());
+   vector<string> buffers;
+   if(numbers.size() > 0 && getblocks(numbers, buffers) == 0)
+   {
+      return 0;
+   }
+   for(int k = 0; k < numbers.size(); k++)
+   {
+      pindata[slot][numbers[k]].swap(buffers[k]);
+   }
+   pinnedblocks += numbers.size();
+   return 1;
+}
+void Filesys::unload(int slot)
+{
+   pinnedblocks -= pindata[slot].size();
+   unordered_map<int,string>().swap(pindata[slot]); //gives the memory back
+   pinned[slot] = 0;
+}
+void Filesys::pinblock(int slot, int blocknumber, string_view buffer)
+{
+   string& copy = pindata[slot][blocknumber];
+   if(copy.empty())
+   {
+      pinnedblocks++;
+   }
+   copy.assign(buffer.data(), buffer.size());
+   copy.append(getblocksize() - buffer.size(), '#'); //padded as putblock pads it
+}
+void Filesys::fatspill()
+{
+   //reads page the fat in but never sync, so they drop pages here when
+   //nobody else is in the file system
+   if(fat.over())
+   {
+      unique_lock<shared_mutex> dl(dirlock, try_to_lock);
+      if(dl.owns_lock())
+      {
+         fat.evict();
+      }
+   }
+}
+int Filesys::dataend()
+{
+   return shadow ? shadowbase : getnumberofblocks();
+}
+void Filesys::reclaim(int blocks)
+{
+   //inside a batch limbo only empties at endbatch, so a batch that
+   //frees and appends over and over would find the disk full
+   bool waiting;
+   {
+      lock_guard<mutex> ll(limbolock);
+      waiting = !limbo.empty() || !committing.empty();
+   }
+   if(waiting && freeblocks() < blocks)
+   {
+      fssynch();
+      fsbarrier();
+   }
+}
+void Filesys::release()
+{
+   //the commit that freed the blocks in committing is on disk now
+   shared_lock<shared_mutex> dl(dirlock);
+   vector<int> ready;
+   {
+      lock_guard<mutex> ll(limbolock);
+      ready.swap(committing);
+   }
+   for(int i = 0; i < ready.size(); i++)
+   {
+      int b = ready[i];
+      int g = groupof(b);
+      lock_guard<mutex> gl(grouplock[g]);
+      fat[b] = grouphead[g]; //onto the front, as freeblock does without limbo
+      if(grouphead[g] == 0)
+      {
+         grouptail[g] = b;
+      }
+      grouphead[g] = b;
+      groupfree[g]++;
+      inlimbo[b] = 0;
+   }
+}
@@ -7,28 +7,226 @@
 #include <sstream>
 #include <fstream>
 #include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include "fat.h"
+#include "directory.h"
 
 using namespace std;
 
+vector<string> block(string buffer, int b); // blocks buffer into padded blocks of size b
+vector<string_view> blockviews(string_view buffer, int b); // the same blocks as views into buffer, the last one short
+
+// A read-only view of a whole file: its blocks back to back, padding
+// and all. A file whose blocks run in order through one host file is
+// mapped in place, with no copy; any other is gathered once into memory
+// of its own. An in-place view also shows later writes to those blocks,
+// so leave the file alone while its view is in use.
+class Fileview
+{
+   friend class Filesys;
+   public:
+      Fileview();
+      ~Fileview();
+      Fileview(const Fileview&) = delete;
+      Fileview& operator=(const Fileview&) = delete;
+      const char* data();
+      size_t size();
+      string_view view();
+      bool inplace();         // mapped from the disk image rather than gathered
+      void close();           // unmaps; the view is empty again
+   private:
+      void* base;             // the mapping, NULL when empty
+      size_t length;          // bytes mapped from base
+      const char* start;      // first byte of the file, base or a little past it
+      size_t bytes;           // file size, whole blocks
+      bool direct;            // base maps the disk image
+};
+
+// Every public member is safe to call from several threads at once.
+// Lock order is dirlock -> filelock[slot] -> grouplock[g]; fssynch takes
+// synclock and then dirlock exclusively, so callers must not hold any
+// of these when it runs.
+//
+// A file of one small block can be kept inline: its payload (the block
+// without its '#' padding) stays in memory with the directory, it reads
+// as block numberofblocks + slot, and fssynch packs every payload into
+// the hidden file .inline, so tiny files cost no data block of their own.
+//
+// Disks with room for it keep two copies of ROOT and FAT: at blocks 0 on
+// and just below the last block, which holds a superblock naming the
+// current copy and a generation. fssynch writes the other copy, then
+// the superblock, so a crash leaves one whole copy. One barrier orders
+// the copy before the superblock; the superblock is durable at the next
+// commit's barrier, or at fsbarrier or fsclose. A freed block stays in
+// limbo until the commit that frees it is durable, so the last commit
+// never sees its blocks reused. A block allocated since the last snapshot
+// is in no commit, so freeing it skips limbo. An append that finds the
+// disk full while limbo holds blocks commits early to get them back,
+// even inside a batch.
+//
+// With the flusher on, a change only marks the metadata dirty and a
+// background thread runs fssynch every interval, or sooner once
+// threshold changes are waiting, so a crash loses at most one interval
+// of changes. fssynch and fsclose still write at once.
+//
+// A pinned file has every block held in memory by block number, so a
+// read of one of its blocks is a lookup: no chain walk and no disk.
+// Writes still go to disk and update the copy. pin() holds a file until
+// unpin(); with setpinning on, a file read threshold times is pinned
+// while it fits in the block budget, pushing out colder promoted files.
+// Read counts halve every pinage reads so old heat fades. Promotion
+// takes pinlock before dirlock.
 class Filesys: public Sdisk
 {
+   friend class Fsck;
+   friend class Defrag;
    public:
       Filesys(string diskname, int numberofblocks, int blocksize);
+      Filesys(const vector<string>& disknames, int numberofblocks, int blocksize, int chunk); // striped, see Sdisk
+      ~Filesys();
       int fsclose(); //closes the file system
-      int fssynch(); //writes the current fat and root onto the disk 
+      int fssynch(); //writes the current fat and root onto the disk
+      int fsbarrier(); //makes the last fssynch durable
       int newfile(string file);
       int rmfile(string file);
       int getfirstblock(string file);
-      int addblock(string file, string block);
+      int addblock(string file, string_view block);
       int delblock(string file, int blocknumber);
-      int readblock(string file, int blocknumber, string& buffer);
-      int writeblock(string file, int blocknumber, string buffer);
+      int readblock(string file, int blocknumber, string& buffer); // appends the block to buffer
+      int readblock(string file, int blocknumber, char* buffer);   // fills blocksize bytes at buffer
+      int writeblock(string file, int blocknumber, string_view buffer);
       int nextblock(string file, int blocknumber);
+      vector<string> ls();    // ROOT names, "xxxxx" for empty slots
+      int addblocks(string file, const vector<string>& blocks); // appends blocks, one write batch
+      int addblocks(string file, const vector<string_view>& blocks);
+      int readblocks(string file, int blocknumber, int count, vector<string>& buffers);
+      int mapfile(string file, Fileview& view); // the whole file as one view; 0 if it does not exist
+      int startbatch();       // defers fssynch until the matching endbatch
+      int endbatch();         // 0 if no batch is open
+      int allocgroups(int groups); // splits the free space into allocation groups
+      int freeblocks();       // free blocks over all groups
+      int setinline(int bytes); // one block files up to bytes live in the directory, 0 off
+      int setflusher(int milliseconds, int threshold); // defers fssynch to a thread, 0 ms off
+      int pin(string file);   // keeps every block of file in memory until unpin
+      int unpin(string file);
+      int setpinning(int blocks, int threshold); // pins files read threshold times while they fit in blocks, 0 off
+      string stats(bool json); // disk and file system counters, as text or one JSON object
+      void resetstats();
+      static constexpr int rootentries(int blocksize) { return blocksize / 12; } // ROOT entries
+      static constexpr int fatwidth(long long numberofblocks); // characters per FAT entry
+      static constexpr int fatblocks(long long numberofblocks, int blocksize); // blocks FAT fills
+   protected:
+      typedef int (*Fetch)(Filesys& fsys, int blocknumber, char* buffer);        // reads one data block
+      typedef int (*Store)(Filesys& fsys, int blocknumber, string_view buffer); // writes one data block
+      int readthrough(string file, int blocknumber, char* buffer, Fetch fetch); // readblock, data blocks by fetch
+      int writethrough(string file, int blocknumber, string_view buffer, Store store); // writeblock, by store
    private:
+      void mount();                // reads ROOT and FAT, or builds them on a new disk
       bool checkblock(string file, int blocknumber);
+      int findfile(string file);   // ROOT slot of file or -1; caller holds dirlock
+      int allocblock(int slot);    // pops a free block for slot, 0 when the disk is full
+      void freeblock(int blocknumber); // pushes blocknumber onto its group's free chain
+      int groupof(int blocknumber);
+      void changed();              // metadata changed: fssynch now, at endbatch, or by the flusher
+      void flushloop();            // body of the flusher thread
+      int tailof(int slot);        // last block of the file in slot; caller holds its filelock
+      vector<int> fatimage();      // fat as stored on disk, group chains joined at fat[0]
+      vector<pair<int,int> > fatpatches(); // entries that differ on disk; caller holds dirlock exclusively
+      void fatspill();             // evicts fat pages if over the limit and dirlock is free
+      int dataend();               // first block past the data area
+      void release();              // limbo blocks of the last commit become free
+      void barrier();              // sync, then trim and free what the last superblock freed; caller holds synclock
+      void reclaim(int blocks);    // commits early if blocks are short and limbo holds some
+      void setfree(const vector<int>& freelist); // rebuilds the group chains from freelist
+      bool isinline(int slot);     // file in slot is held in inlinedata
+      bool fitsinline(string_view buffer);
+      int outline(int slot);       // moves an inline file to a data block; caller holds its filelock
+      void packinline(vector<int>& blocks, vector<string>& buffers); // caller holds dirlock exclusively
+      void heatup(int slot);       // counts a read of slot, aging every count now and then
+      void promote(string file);   // pins file if it is hot enough and room can be made
+      int load(int slot);          // reads the file in slot into pindata; caller holds its filelock exclusively
+      void unload(int slot);       // drops the file in slot from memory; same lock
+      void pinblock(int slot, int blocknumber, string_view buffer); // a changed block of a pinned file; same lock
+      int coldest();               // promoted slot with the least heat, -1 if none; caller holds pinlock
       int rootsize;           // maximum number of entries in ROOT
       int fatsize;            // number of blocks occupied by FAT
-      vector<string> filename;   // filenames in ROOT
-      vector<int> firstblock; // firstblocks in ROOT
-      vector<int> fat;             // FAT
+      Directory root;         // names and first blocks of ROOT, one record per slot
+      vector<int> lastblock;  // cached chain tails in ROOT, 0 if not known
+      vector<char> freed;     // freed since the last fssynch, under its group's lock
+      vector<int> freedlist;  // blocks marked in freed, for the next discard
+      mutex freedlock;        // freedlist
+      Fat fat;                // FAT, paged in as chains touch it; evicted only under an exclusive dirlock
+      shared_mutex dirlock;   // ROOT layout; exclusive for newfile/rmfile/fssynch
+      vector<shared_mutex> filelock; // one per ROOT slot, guards that file's chain and data
+      int groupsize;          // data blocks per allocation group
+      vector<int> grouphead;  // first free block of each group, 0 if empty
+      vector<int> grouptail;  // last free block of each group
+      vector<int> groupfree;  // free blocks in each group
+      vector<mutex> grouplock; // one per group, guards its chain and counter
+      mutex synclock;         // keeps fssynch writes in snapshot order
+      atomic<int> batchdepth; // open startbatch calls
+      atomic<bool> dirty;     // metadata changed inside a batch
+      atomic<int> inlinelimit;   // largest payload kept in the directory, 0 for none
+      vector<string> inlinedata; // payload of each inline file by ROOT slot
+      atomic<bool> inlinedirty;  // inlinedata changed since the last fssynch
+      bool shadow;            // two copies of ROOT and FAT, flipped by the superblock
+      int shadowbase;         // ROOT of the second copy; its FAT follows, the superblock ends the disk
+      int area;               // copy the superblock names, 0 at block 0, 1 at shadowbase
+      long long generation;   // commits made; kept in the superblock
+      bool level;             // the other copy's FAT matches this one wherever flush leaves it alone
+      vector<int> limbo;      // freed since the last snapshot; not reusable yet
+      vector<int> snapped;    // freed before the snapshot being written, under synclock
+      vector<int> committing; // freed before the last superblock written
+      vector<char> inlimbo;   // in limbo or committing
+      vector<int> bornin;     // snapshots when each block was last allocated, -1 if never
+      int snapshots;          // snapshots taken; changes under an exclusive dirlock
+      mutex limbolock;        // limbo, committing
+      atomic<bool> flushing;  // the flusher thread is running
+      atomic<int> unsynced;   // changes since the last snapshot
+      int flushinterval;      // milliseconds between flusher runs
+      int flushthreshold;     // unsynced changes that wake the flusher early
+      bool flushstop;         // flusher should sync what is left and exit
+      mutex flushlock;        // flushstop, and the flusher's waits
+      condition_variable flushwake;
+      thread flusher;
+      vector<char> pinned;    // 0, 1 pinned by pin(), 2 promoted; under pinlock and filelock, or dirlock exclusively
+      vector<unordered_map<int,string> > pindata; // blocks of each pinned file by block number, under its filelock
+      atomic<int> pinnedblocks; // blocks held in pindata
+      vector<atomic<int> > heat; // recent reads of each file
+      atomic<int> pinreads;   // reads since heat last halved
+      atomic<int> pinlimit;   // blocks promoted files may fill, 0 for no promotion
+      atomic<int> pinthreshold; // reads that make a file worth promoting
+      mutex pinlock;          // one promotion, pin or unpin at a time
+      static const int pinage = 4096; // reads between halvings of heat
+      Histogram synctime;     // fssynch, snapshot to the last write
+      Counter chainsteps;     // FAT links followed to find a block or a tail
+      Counter dirscans;       // findfile calls
+      Counter dirprobes;      // ROOT entries they compared
+      Counter tailhits;       // appends that found the tail in lastblock
+      Counter tailwalks;      // appends that walked to it
+      Counter inlinehits;     // reads served from the directory
+      Counter pinhits;        // reads served from pindata
+      Counter mapsinplace;    // mapfile calls that needed no copy
+      Counter mapsgathered;   // mapfile calls that copied the blocks together
 };
+
+constexpr int Filesys::fatwidth(long long numberofblocks)
+{
+   //6 characters hold "nnnnn "; bigger disks need wider FAT entries
+   int width = 6;
+   for(long long n = 100000; n < numberofblocks; n *= 10)
+   {
+      width++;
+   }
+   return width;
+}
+constexpr int Filesys::fatblocks(long long numberofblocks, int blocksize)
+{
+   return numberofblocks * fatwidth(numberofblocks) / blocksize + 1;
+}
@@ -0,0 +1,138 @@
+#include <array>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstring>
+#include <unistd.h>
+
+using namespace std;
+
+// A Filesys whose block size is fixed when it is compiled. Blocksize must
+// be a power of two, so the data block paths behind readblock and
+// writeblock find a block's offset with shifts and move exactly
+// Blocksize bytes with no runtime length; ROOT and FAT sizes are the
+// constants Filesys would work out. A block is a fixed-size array. On
+// a compressed, mirrored or direct disk those paths fall back to the
+// runtime ones. The disk on the host is the same as a Filesys of that
+// block size makes, so the two can share disks.
+template<int Blocksize>
+class Fixedfs: public Filesys
+{
+   static_assert(Blocksize >= 128 && (Blocksize & (Blocksize - 1)) == 0,
+                 "block size must be a power of two of at least 128");
+   public:
+      typedef array<char, Blocksize> Block;
+      static constexpr int blocksize = Blocksize;
+      static constexpr int rootsize = rootentries(Blocksize); // ROOT entries
+      Fixedfs(string diskname, int numberofblocks);
+      Fixedfs(const vector<string>& disknames, int numberofblocks, int chunk); // striped
+      using Filesys::readblock;
+      using Filesys::writeblock;
+      using Filesys::addblock;
+      int readblock(string file, int blocknumber, Block& buffer);
+      int writeblock(string file, int blocknumber, const Block& buffer);
+      int addblock(string file, const Block& buffer);
+      static Block fill(string_view data); // data padded with '#' to one block; data must fit
+   private:
+      static int fetch(Filesys& fsys, int blocknumber, char* buffer);
+      static int store(Filesys& fsys, int blocknumber, string_view buffer);
+};
+
+template<int Blocksize>
+Fixedfs<Blocksize>::Fixedfs(string diskname, int numberofblocks): Filesys(diskname, numberofblocks, Blocksize)
+{
+}
+template<int Blocksize>
+Fixedfs<Blocksize>::Fixedfs(const vector<string>& disknames, int numberofblocks, int chunk): Filesys(disknames, numberofblocks, Blocksize, chunk)
+{
+}
+template<int Blocksize>
+inline int Fixedfs<Blocksize>::readblock(string file, int blocknumber, Block& buffer)
+{
+   return readthrough(file, blocknumber, buffer.data(), fetch);
+}
+template<int Blocksize>
+inline int Fixedfs<Blocksize>::writeblock(string file, int blocknumber, const Block& buffer)
+{
+   return writethrough(file, blocknumber, string_view(buffer.data(), Blocksize), store);
+}
+template<int Blocksize>
+inline int Fixedfs<Blocksize>::addblock(string file, const Block& buffer)
+{
+   return Filesys::addblock(file, string_view(buffer.data(), Blocksize));
+}
+template<int Blocksize>
+inline typename Fixedfs<Blocksize>::Block Fixedfs<Blocksize>::fill(string_view data)
+{
+   Block buffer;
+   memset(buffer.data(), '#', Blocksize);
+   data.copy(buffer.data(), Blocksize);
+   return buffer;
+}
+template<int Blocksize>
+int Fixedfs<Blocksize>::fetch(Filesys& fsys, int blocknumber, char* buffer)
+{
+   return fsys.getfixed<Blocksize>(blocknumber, buffer);
+}
+template<int Blocksize>
+int Fixedfs<Blocksize>::store(Filesys& fsys, int blocknumber, string_view buffer)
+{
+   //an inline file can hand a short buffer on its way out to a block
+   if(buffer.size() < Blocksize)
+   {
+      return fsys.putblock(blocknumber, buffer);
+   }
+   return fsys.putfixed<Blocksize>(blocknumber, buffer.data());
+}
+
+// Sdisk's compile-time paths: the plain image only, no compression,
+// mirrors or direct I/O, which keep their runtime code.
+template<int Blocksize>
+inline int Sdisk::place(int blocknumber, off_t& offset)
+{
+   constexpr int shift = __builtin_ctz(Blocksize);
+   if(fds.size() == 1)
+   {
+      offset = (off_t)blocknumber << shift;
+      return fds[0];
+   }
+   int unit = blocknumber / chunk;
+   int stripes = fds.size();
+   offset = ((off_t)(unit / stripes) * chunk + blocknumber % chunk) << shift;
+   return fds[unit % stripes];
+}
+template<int Blocksize>
+int Sdisk::getfixed(int blocknumber, char* buffer)
+{
+   if(zdisk != NULL || mirrored || direct || blocknumber < 0 || blocknumber >= numberofblocks)
+   {
+      return getblock(blocknumber, buffer);
+   }
+   long long start = Histogram::now();
+   off_t offset;
+   int fd = place<Blocksize>(blocknumber, offset);
+   int ok = pread(fd, buffer, Blocksize, offset) == Blocksize ? 1 : 0;
+   if(ok && holes[blocknumber])
+   {
+      memset(buffer, '#', Blocksize); //as unhole fills it
+   }
+   readtime.add(Histogram::now() - start);
+   blocksread.add(ok);
+   return ok;
+}
+template<int Blocksize>
+int Sdisk::putfixed(int blocknumber, const char* buffer)
+{
+   if(zdisk != NULL || mirrored || direct || blocknumber < 0 || blocknumber >= numberofblocks)
+   {
+      return putblock(blocknumber, string_view(buffer, Blocksize));
+   }
+   long long start = Histogram::now();
+   cancel(blocknumber);
+   off_t offset;
+   int fd = place<Blocksize>(blocknumber, offset);
+   int ok = pwrite(fd, buffer, Blocksize, offset) == Blocksize ? 1 : 0;
+   writetime.add(Histogram::now() - start);
+   blockswritten.add(ok);
+   return ok;
+}
@@ -0,0 +1,228 @@
+#include "sdisk.h"
+#include "filesys.h"
+#include "fsck.h"
+#include <thread>
+
+Fsck::Fsck(Filesys& fsys, int threads): fsys(fsys)
+{
+   this->threads = threads > 0 ? threads : 1;
+}
+int Fsck::check(bool repair)
+{
+   unique_lock<shared_mutex> dl(fsys.dirlock); //nothing moves while we look
+   int n = fsys.getnumberofblocks();
+   dataend = fsys.dataend(); //the second ROOT and FAT and the superblock follow
+   datastart = fsys.fatsize + 1;
+   image = fsys.fatimage();
+   heads = vector<int>(fsys.rootsize, 0);
+   for(int i = 0; i < heads.size(); i++)
+   {
+      if(fsys.root.used(i) && !fsys.isinline(i)) //free slots and inline files own no blocks
+      {
+         heads[i] = fsys.root.first(i);
+      }
+   }
+   freechain = heads.size();
+   heads.push_back(image[0]);
+   refs = vector<atomic<int> >(n);
+   owner = vector<atomic<int> >(n);
+   reported = vector<atomic<char> >(n);
+   cuts = vector<int>(heads.size(), 0);
+   leaks = vector<vector<int> >(threads);
+   problems = 0;
+
+   //phase 1: reference counts, the FAT split into one range per thread
+   vector<thread> pool;
+   int range = (dataend - datastart + threads - 1) / threads;
+   for(int t = 0; t < threads; t++)
+   {
+      int first = datastart + t * range;
+      int last = first + range < dataend ? first + range : dataend;
+      pool.push_back(thread(&Fsck::countrange, this, first, last));
+   }
+   for(int t = 0; t < pool.size(); t++)
+   {
+      pool[t].join();
+   }
+   pool.clear();
+   for(int i = 0; i < heads.size(); i++)
+   {
+      if(heads[i] >= datastart && heads[i] < dataend)
+      {
+         refs[heads[i]]++;
+      }
+   }
+
+   //phase 2: the file chains walked at once, claiming blocks as they go;
+   //the free chain goes last so a block it shares stays with the file
+   atomic<int> next(0);
+   for(int t = 0; t < threads; t++)
+   {
+      pool.push_back(thread([this, &next]()
+      {
+         for(int c = next++; c < freechain; c = next++)
+         {
+            walkchain(c);
+         }
+      }));
+   }
+   for(int t = 0; t < pool.size(); t++)
+   {
+      pool[t].join();
+   }
+   pool.clear();
+   walkchain(freechain);
+   for(int b = datastart; b < dataend; b++)
+   {
+      //the walk names both chains of a cross-link or cycle; what is left
+      //has a second link from a block no chain reaches
+      if(refs[b] > 1 && !reported[b])
+      {
+         problem("block " + to_string(b) + " is linked from " + to_string(refs[b]) + " places");
+      }
+   }
+
+   //phase 3: blocks nobody claimed
+   for(int t = 0; t < threads; t++)
+   {
+      int first = datastart + t * range;
+      int last = first + range < dataend ? first + range : dataend;
+      pool.push_back(thread(&Fsck::leakrange, this, t, first, last));
+   }
+   for(int t = 0; t < pool.size(); t++)
+   {
+      pool[t].join();
+   }
+   int leaked = 0;
+   for(int t = 0; t < leaks.size(); t++)
+   {
+      leaked += leaks[t].size();
+   }
+   if(leaked > 0)
+   {
+      problem(to_string(leaked) + " blocks are neither in a file nor on the free chain");
+   }
+   int counted = fsys.limbo.size() + fsys.committing.size(); //on the free chain, not yet reusable
+   for(int g = 0; g < fsys.groupfree.size(); g++)
+   {
+      counted += fsys.groupfree[g];
+   }
+   int reachable = 0;
+   for(int b = datastart; b < dataend; b++)
+   {
+      if(owner[b] == freechain + 1)
+      {
+         reachable++;
+      }
+   }
+   if(counted != reachable)
+   {
+      problem("free counters say " + to_string(counted) + " blocks, the free chain reaches " + to_string(reachable));
+   }
+
+   if(repair && problems > 0)
+   {
+      //cut the broken file chains, then every data block no file reaches is free
+      for(int c = 0; c < freechain; c++)
+      {
+         if(cuts[c] == -1)
+         {
+            fsys.root.first(c) = 0;
+         }
+         else if(cuts[c] > 0)
+         {
+            fsys.fat[cuts[c]] = 0;
+         }
+         fsys.lastblock[c] = 0;
+         fsys.unload(c); //a pinned copy may hold blocks cut off the chain
+      }
+      vector<bool> used(n, false);
+      for(int c = 0; c < freechain; c++)
+      {
+         for(int b = fsys.root.first(c); b > 0 && b < n && fsys.root.used(c); b = fsys.fat[b])
+         {
+            used[b] = true;
+         }
+      }
+      vector<int> freelist;
+      for(int b = datastart; b < dataend; b++)
+      {
+         if(!used[b])
+         {
+            freelist.push_back(b);
+         }
+      }
+      fsys.setfree(freelist);
+      cout << "Repaired: " << freelist.size() << " free blocks" << endl;
+      dl.unlock();
+      fsys.fssynch();
+   }
+   else
+   {
+      fsys.fat.evict(); //the walk paged in the whole fat
+   }
+   return problems;
+}
+void Fsck::countrange(int first, int last)
+{
+   for(int b = first; b < last; b++)
+   {
+      int next = image[b];
+      if(next != 0 && next >= datastart && next < dataend)
+      {
+         refs[next]++;
+      }
+   }
+}
+void Fsck::walkchain(int chain)
+{
+   //claims each block for chain; a block someone else holds is a
+   //cross-link, one this chain holds is a cycle, and either way the
+   //chain is cut in front of it
+   string name = chain == freechain ? "free chain" : "file " + string(fsys.root.name(chain));
+   int prev = -1;
+   int b = heads[chain];
+   while(b != 0)
+   {
+      if(b < datastart || b >= dataend)
+      {
+         problem(name + " points outside the data area at block " + to_string(b));
+         cuts[chain] = prev;
+         return;
+      }
+      int expected = 0;
+      if(!owner[b].compare_exchange_strong(expected, chain + 1))
+      {
+         if(expected == chain + 1)
+         {
+            problem(name + " loops back to block " + to_string(b));
+         }
+         else
+         {
+            string other = expected == freechain + 1 ? "the free chain" : "file " + string(fsys.root.name(expected - 1));
+            problem(name + " shares block " + to_string(b) + " with " + other);
+         }
+         reported[b] = 1;
+         cuts[chain] = prev;
+         return;
+      }
+      prev = b;
+      b = image[b];
+   }
+}
+void Fsck::leakrange(int range, int first, int last)
+{
+   for(int b = first; b < last; b++)
+   {
+      if(owner[b] == 0)
+      {
+         leaks[range].push_back(b);
+      }
+   }
+}
+void Fsck::problem(string message)
+{
+   lock_guard<mutex> rl(reportlock);
+   cout << message << endl;
+   problems++;
+}
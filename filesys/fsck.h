@@ -0,0 +1,40 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <atomic>
+
+using namespace std;
+
+// Consistency checker for a mounted Filesys. check() holds the file
+// system still while it
+//    - counts references to every block, one FAT range per thread,
+//    - walks every file chain and the free chain in parallel, claiming
+//      blocks in a shared owner table so cross-links and cycles show up,
+//    - scans the owner table by range for leaked blocks.
+// With repair set, broken chains are cut, and the free chain is rebuilt
+// from every data block that no file owns.
+class Fsck
+{
+   public:
+      Fsck(Filesys& fsys, int threads);
+      int check(bool repair); // returns the number of problems found
+   private:
+      void countrange(int first, int last); // phase 1, one FAT range
+      void walkchain(int chain);            // phase 2, one chain
+      void leakrange(int range, int first, int last); // phase 3, one FAT range
+      void problem(string message);
+      Filesys& fsys;
+      int threads;
+      int datastart;          // first block after ROOT and FAT
+      int dataend;            // first block past the data area
+      int freechain;          // chain number of the free chain
+      vector<int> image;      // FAT as stored on disk
+      vector<int> heads;      // first block of each chain, files then free
+      vector<atomic<int> > refs;  // FAT and ROOT entries naming each block
+      vector<atomic<int> > owner; // chain+1 that claimed each block, 0 if none
+      vector<atomic<char> > reported; // block found shared or looped by a walk
+      vector<int> cuts;       // chain -> block whose link is cut (-1 cuts the head)
+      vector<vector<int> > leaks; // leaked blocks found by each range
+      mutex reportlock;
+      int problems;
+};
@@ -0,0 +1,36 @@
+// Checks a disk image and, with -r, repairs it:
+//    ./FSCK diskname numberofblocks blocksize [-r] [threads]
+
+#include "sdisk.h"
+#include "filesys.h"
+#include "fsck.h"
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+int main(int argc, char* argv[])
+{
+   if(argc < 4)
+   {
+      cout << "usage: " << argv[0] << " diskname numberofblocks blocksize [-r] [threads]" << endl;
+      return 1;
+   }
+   bool repair = false;
+   int threads = thread::hardware_concurrency();
+   for(int i = 4; i < argc; i++)
+   {
+      if(strcmp(argv[i], "-r") == 0)
+      {
+         repair = true;
+      }
+      else
+      {
+         threads = atoi(argv[i]);
+      }
+   }
+   Filesys fsys(argv[1], atoi(argv[2]), atoi(argv[3]));
+   Fsck fsck(fsys, threads);
+   int problems = fsck.check(repair);
+   cout << argv[1] << ": " << problems << " problems" << endl;
+   return problems == 0 ? 0 : 1;
+}
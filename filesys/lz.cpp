@@ -0,0 +1,124 @@
+#include "lz.h"
+#include <cstring>
+#include <vector>
+
+static unsigned int read32(const char* p)
+{
+   unsigned int v;
+   memcpy(&v, p, 4);
+   return v;
+}
+static void putlength(string& out, int length)
+{
+   //lengths past the nibble go out as 255s and a remainder
+   while(length >= 255)
+   {
+      out += (char)255;
+      length -= 255;
+   }
+   out += (char)length;
+}
+int lzcompress(const char* in, int length, string& out)
+{
+   int start = out.size();
+   vector<int> table(4096, -1); //last position of each hashed 4 byte sequence
+   int anchor = 0;
+   int i = 0;
+   while(i + 4 <= length)
+   {
+      unsigned int seq = read32(in + i);
+      int h = (seq * 2654435761u) >> 20;
+      int ref = table[h];
+      table[h] = i;
+      if(ref < 0 || i - ref > 65535 || read32(in + ref) != seq)
+      {
+         i++;
+         continue;
+      }
+      int match = 4;
+      while(i + match < length && in[ref + match] == in[i + match])
+      {
+         match++;
+      }
+      int literals = i - anchor;
+      out += (char)(((literals < 15 ? literals : 15) << 4) | (match - 4 < 15 ? match - 4 : 15));
+      if(literals >= 15)
+      {
+         putlength(out, literals - 15);
+      }
+      out.append(in + anchor, literals);
+      out += (char)((i - ref) & 255);
+      out += (char)((i - ref) >> 8);
+      if(match - 4 >= 15)
+      {
+         putlength(out, match - 4 - 15);
+      }
+      i += match;
+      anchor = i;
+   }
+   int literals = length - anchor; //last sequence is literals only
+   out += (char)((literals < 15 ? literals : 15) << 4);
+   if(literals >= 15)
+   {
+      putlength(out, literals - 15);
+   }
+   out.append(in + anchor, literals);
+   return out.size() - start;
+}
+int lzdecompress(const char* in, int length, char* out, int capacity)
+{
+   const unsigned char* ip = (const unsigned char*)in;
+   const unsigned char* end = ip + length;
+   int op = 0;
+   while(ip < end)
+   {
+      int token = *ip++;
+      int literals = token >> 4;
+      if(literals == 15)
+      {
+         int more = 255;
+         while(more == 255 && ip < end)
+         {
+            more = *ip++;
+            literals += more;
+         }
+      }
+      if(literals > end - ip || op + literals > capacity)
+      {
+         return -1;
+      }
+      memcpy(out + op, ip, literals);
+      ip += literals;
+      op += literals;
+      if(ip >= end)
+      {
+         break; //last sequence has no match
+      }
+      if(end - ip < 2)
+      {
+         return -1;
+      }
+      int offset = ip[0] | (ip[1] << 8);
+      ip += 2;
+      int match = (token & 15);
+      if(match == 15)
+      {
+         int more = 255;
+         while(more == 255 && ip < end)
+         {
+            more = *ip++;
+            match += more;
+         }
+      }
+      match += 4;
+      if(offset == 0 || offset > op || op + match > capacity)
+      {
+         return -1;
+      }
+      for(int i = 0; i < match; i++, op++)
+      {
+         out[op] = out[op - offset]; //byte at a time so overlapping runs repeat
+      }
+   }
+   return op;
+}
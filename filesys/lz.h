@@ -0,0 +1,9 @@
+#include <string>
+
+using namespace std;
+
+// Byte-oriented LZ77 codec in the LZ4 style: each sequence is a token
+// (literal count in the high nibble, match length - 4 in the low one),
+// the literals, and a two byte offset back into the output.
+int lzcompress(const char* in, int length, string& out); // appends to out, returns bytes added
+int lzdecompress(const char* in, int length, char* out, int capacity); // returns bytes out or -1
@@ -3,83 +3,1091 @@
 // 4/19/16
 
 #include "sdisk.h"
+#include "zdisk.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <climits>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
 
 Sdisk::Sdisk(string diskname, int numberofblocks, int blocksize)
 {
    this->diskname = diskname; //set diskname
    this->numberofblocks = numberofblocks; //set number of blocks
    this->blocksize = blocksize; //set blocksize
-
-   fstream disk(diskname.c_str());   
-   if(!disk.good()) //if file does not exist
+   attach(vector<string>(1, diskname), numberofblocks);
+   if(access((diskname + ".zmap").c_str(), F_OK) == 0)
+   {
+      zdisk = new Zdisk(diskname, numberofblocks, blocksize); //compressed last time, stay that way
+   }
+}
+Sdisk::Sdisk(const vector<string>& disknames, int numberofblocks, int blocksize, int chunk)
+{
+   this->diskname = disknames[0];
+   this->numberofblocks = numberofblocks;
+   this->blocksize = blocksize;
+   attach(disknames, chunk);
+}
+void Sdisk::attach(const vector<string>& disknames, int chunk)
+{
+   mirrored = disknames.size() > 1 && chunk == mirror;
+   this->chunk = disknames.size() > 1 && !mirrored ? max(chunk, 1) : numberofblocks;
+   int units = (numberofblocks + this->chunk - 1) / this->chunk;
+   for(int s = 0; s < disknames.size(); s++)
+   {
+      const char* name = disknames[s].c_str();
+      fstream disk(name);
+      if(!disk.good()) //if file does not exist
+      {
+         disk.open(name, ios::out); //create it
+         string fill(blocksize, '#'); //memory
+         int blocks = (units - s + (int)disknames.size() - 1) / disknames.size() * this->chunk;
+         if(disknames.size() == 1 || mirrored)
+         {
+            blocks = numberofblocks;
+         }
+         for(int i = 0; i < blocks; i++)
+         {
+            disk.write(fill.data(), blocksize);
+         }
+         disk.close();
+      }
+      //one descriptor per file for the life of the disk; pread/pwrite carry
+      //their own offset so concurrent readers and writers never share a
+      //file position
+      int fd = open(name, O_RDWR);
+      if(fd < 0)
+      {
+         cout << "Cannot open " << disknames[s] << endl;
+      }
+      fds.push_back(fd);
+   }
+   padding = string(blocksize, '#');
+   trimming = false;
+   trimstop = false;
+   trimbusy = false;
+   pending = vector<atomic<char> >(numberofblocks);
+   holes = vector<atomic<char> >(numberofblocks);
+   zdisk = NULL;
+   direct = false;
+   sumfd = -1;
+   turn = 0;
+   if(mirrored)
    {
-      disk.open(diskname.c_str(), ios::out); //create it
-      for(int i = 0; i < (numberofblocks * blocksize); i++)
+      sums = vector<atomic<unsigned int> >(numberofblocks);
+      sumdirty = vector<atomic<char> >((numberofblocks + sumpage - 1) / sumpage);
+      depth = vector<atomic<int> >(fds.size());
+      string zero(blocksize, '\0');
+      holesum = blockhash(zero.data(), blocksize);
+      sumfd = open((diskname + ".sums").c_str(), O_RDWR | O_CREAT, 0644);
+      vector<unsigned int> saved(numberofblocks);
+      ssize_t length = (ssize_t)numberofblocks * sizeof(unsigned int);
+      struct stat st;
+      if(sumfd >= 0 && fstat(sumfd, &st) == 0 && st.st_size == length
+         && pread(sumfd, &saved[0], length, 0) == length)
+      {
+         for(int b = 0; b < numberofblocks; b++)
+         {
+            sums[b] = saved[b];
+         }
+      }
+      else
       {
-         disk.put('#'); //memory
+         //first mount as a mirror: the first replica is taken as good, and
+         //blocks of the others that differ are repaired as they are read
+         string block(blocksize, '#');
+         for(int b = 0; b < numberofblocks; b++)
+         {
+            pread(fds[0], &block[0], blocksize, (off_t)b * blocksize);
+            summarize(b, block.data());
+         }
+         savesums();
       }
-      disk.close();
+   }
+}
+Sdisk::~Sdisk()
+{
+   settrim(false);
+   if(zdisk != NULL)
+   {
+      delete zdisk;
+   }
+   if(sumfd >= 0)
+   {
+      savesums();
+      close(sumfd);
+   }
+   for(int s = 0; s < fds.size(); s++)
+   {
+      if(fds[s] >= 0)
+      {
+         close(fds[s]);
+      }
+   }
+   for(int i = 0; i < slabs.size(); i++)
+   {
+      free(slabs[i]);
    }
 }
 int Sdisk::getblock(int blocknumber, string& buffer)
 {
-   
-   fstream infile; //fstream
-   infile.open(diskname.c_str(), ios::in); //open diskname
-   infile.seekg(blocknumber*blocksize); //move get pointer 
-   char c; //initialize character c
-   infile.get(c); //load c with value of get pointer (after, get pointer += 1)
-   int i = 0; 
-   while(infile.good() && i < blocksize) //while file is good and loop blocksize times
+   size_t start = buffer.size();
+   buffer.resize(start + blocksize); //block is appended to buffer
+   if(getblock(blocknumber, &buffer[start]) == 0)
    {
-      buffer += c; //add char c to string buffer
-      infile.get(c); //load c with new value and move pointer
-      i++; //increment
+      buffer.resize(start);
+      return 0; //failed
    }
-
-   infile.seekg(blocknumber*blocksize); //move get pointer to beginning of block
-   infile.get(c); //load c
-   //check character by character if string buffer matches the position of get pointer
-   for(int i = 0; i < buffer.size(); i++)
+   return 1; //success
+}
+int Sdisk::getblock(int blocknumber, char* buffer)
+{
+   long long start = Histogram::now();
+   int ok = readone(blocknumber, buffer);
+   readtime.add(Histogram::now() - start);
+   blocksread.add(ok);
+   return ok;
+}
+int Sdisk::readone(int blocknumber, char* buffer)
+{
+   if(blocknumber < 0 || blocknumber >= numberofblocks)
+   {
+      return 0; //failed
+   }
+   if(zdisk != NULL && zdisk->getblock(blocknumber, buffer) == 1)
+   {
+      return 1;
+   }
+   off_t offset;
+   int fd = locate(blocknumber, offset);
+   int s = 0;
+   if(mirrored)
+   {
+      s = quietest();
+      fd = fds[s];
+      depth[s]++;
+   }
+   ssize_t n;
+   if(direct)
+   {
+      char* slab = take();
+      n = -1; //no slab, no read
+      if(slab != NULL)
+      {
+         n = pread(fd, slab, blocksize, offset);
+         memcpy(buffer, slab, blocksize);
+         give(slab);
+      }
+   }
+   else
+   {
+      n = pread(fd, buffer, blocksize, offset);
+   }
+   if(mirrored)
    {
-      if(buffer[i] != c)
+      depth[s]--;
+      if((n != blocksize || !verify(blocknumber, buffer)) && fallback(blocknumber, buffer) == 0)
       {
-         return 0; //failed
+         return 0;
       }
-      infile.get(c);
    }
-   infile.close();
+   else if(n != blocksize)
+   {
+      return 0; //failed
+   }
+   unhole(blocknumber, buffer);
    return 1; //success
 }
-int Sdisk::putblock(int blocknumber, string buffer)
+int Sdisk::putblock(int blocknumber, string_view buffer)
+{
+   long long start = Histogram::now();
+   int ok = writeone(blocknumber, buffer);
+   writetime.add(Histogram::now() - start);
+   blockswritten.add(ok);
+   return ok;
+}
+int Sdisk::writeone(int blocknumber, string_view buffer)
 {
    //if string is larger than blocksize, then cannot put
-   if(buffer.length() > blocksize)
+   if(buffer.length() > blocksize || blocknumber < 0 || blocknumber >= numberofblocks)
    {
       return 0;
    }
-
-   fstream outfile; //fstream
-   outfile.open(diskname.c_str(), ios::in | ios::out); //open file and delcare it as both input and output
-   outfile.seekp(blocknumber*blocksize); //move put pointer
-   int i = 0;
-   while(outfile.good() && i < blocksize) //while file is good and loop blocksize times
-   {
-      outfile.put(buffer[i]); //write character (position i) to file (after, move put pointer by one)
-      i++;
-   }
-   outfile.close();
-   
-   string test; //test if success
-   getblock(blocknumber, test); //load string test with block blocknumber
-   if(test == buffer) //if string test = string buffer
-   {
-      return 1; //success
-   }  
+   cancel(blocknumber);
+   if(zdisk != NULL)
+   {
+      if(buffer.length() < blocksize)
+      {
+         string padded(buffer);
+         padded.append(blocksize - buffer.length(), '#'); //pad like block()
+         return zdisk->putblock(blocknumber, padded.data());
+      }
+      return zdisk->putblock(blocknumber, buffer.data());
+   }
+   //a mirrored block goes to each replica in turn; one block is too
+   //little to be worth a thread per replica
+   off_t offset;
+   int fd = locate(blocknumber, offset);
+   int copies = mirrored ? fds.size() : 1;
+   int ok = 1;
+   if(direct)
+   {
+      char* slab = take();
+      if(slab == NULL)
+      {
+         return 0;
+      }
+      memcpy(slab, buffer.data(), buffer.length());
+      memset(slab + buffer.length(), '#', blocksize - buffer.length());
+      for(int s = 0; s < copies; s++)
+      {
+         if(pwrite(mirrored ? fds[s] : fd, slab, blocksize, offset) != blocksize)
+         {
+            ok = 0;
+         }
+      }
+      if(mirrored)
+      {
+         summarize(blocknumber, slab);
+      }
+      give(slab);
+      return ok;
+   }
+   //a short buffer goes down followed by padding, so it is never copied
+   iovec iov[2];
+   iov[0].iov_base = (void*)buffer.data();
+   iov[0].iov_len = buffer.length();
+   iov[1].iov_base = (void*)padding.data();
+   iov[1].iov_len = blocksize - buffer.length();
+   for(int s = 0; s < copies; s++)
+   {
+      if(pwritev(mirrored ? fds[s] : fd, iov, buffer.length() < blocksize ? 2 : 1, offset) != blocksize)
+      {
+         ok = 0; //failure
+      }
+   }
+   if(mirrored)
+   {
+      if(buffer.length() < blocksize)
+      {
+         string padded(buffer);
+         padded.append(blocksize - buffer.length(), '#');
+         summarize(blocknumber, padded.data());
+      }
+      else
+      {
+         summarize(blocknumber, buffer.data());
+      }
+   }
+   return ok;
+}
+int Sdisk::getblocks(const vector<int>& blocknumbers, vector<string>& buffers)
+{
+   buffers.resize(blocknumbers.size());
+   int ok = 1;
+   if(zdisk != NULL)
+   {
+      for(int i = 0; i < blocknumbers.size(); i++)
+      {
+         buffers[i].clear();
+         ok &= getblock(blocknumbers[i], buffers[i]);
+      }
+      return ok;
+   }
+   long long start = Histogram::now();
+   vector<char*> data(blocknumbers.size());
+   for(int i = 0; i < blocknumbers.size(); i++)
+   {
+      buffers[i].resize(blocksize);
+      data[i] = &buffers[i][0];
+   }
+   ok = transfer(blocknumbers, data, false);
+   readtime.add(Histogram::now() - start);
+   blocksread.add(ok ? blocknumbers.size() : 0);
+   for(int i = 0; i < blocknumbers.size(); i++)
+   {
+      unhole(blocknumbers[i], data[i]);
+   }
+   return ok;
+}
+int Sdisk::getblocks(const vector<int>& blocknumbers, char* buffer)
+{
+   int ok = 1;
+   if(zdisk != NULL)
+   {
+      for(int i = 0; i < blocknumbers.size(); i++)
+      {
+         ok &= getblock(blocknumbers[i], buffer + (size_t)i * blocksize);
+      }
+      return ok;
+   }
+   long long start = Histogram::now();
+   vector<char*> data(blocknumbers.size());
+   for(int i = 0; i < blocknumbers.size(); i++)
+   {
+      data[i] = buffer + (size_t)i * blocksize;
+   }
+   ok = transfer(blocknumbers, data, false);
+   readtime.add(Histogram::now() - start);
+   blocksread.add(ok ? blocknumbers.size() : 0);
+   for(int i = 0; i < blocknumbers.size(); i++)
+   {
+      unhole(blocknumbers[i], data[i]);
+   }
+   return ok;
+}
+int Sdisk::putblocks(const vector<int>& blocknumbers, const vector<string>& buffers)
+{
+   vector<string_view> views(buffers.begin(), buffers.end());
+   return putblocks(blocknumbers, views);
+}
+int Sdisk::putblocks(const vector<int>& blocknumbers, const vector<string_view>& buffers)
+{
+   int ok = 1;
+   if(zdisk != NULL)
+   {
+      for(int i = 0; i < blocknumbers.size(); i++)
+      {
+         ok &= putblock(blocknumbers[i], buffers[i]);
+      }
+      return ok;
+   }
+   long long start = Histogram::now();
+   vector<char*> data(blocknumbers.size());
+   vector<string> padded(blocknumbers.size()); //short buffers are padded like block()
+   for(int i = 0; i < blocknumbers.size(); i++)
+   {
+      string_view buffer = buffers[i];
+      if(buffer.length() > blocksize)
+      {
+         return 0;
+      }
+      if(buffer.length() < blocksize)
+      {
+         padded[i].assign(buffer.data(), buffer.length());
+         padded[i].append(blocksize - buffer.length(), '#');
+         data[i] = &padded[i][0];
+      }
+      else
+      {
+         data[i] = (char*)buffer.data();
+      }
+   }
+   for(int i = 0; i < blocknumbers.size(); i++)
+   {
+      if(blocknumbers[i] >= 0 && blocknumbers[i] < numberofblocks)
+      {
+         cancel(blocknumbers[i]);
+      }
+   }
+   ok = transfer(blocknumbers, data, true);
+   writetime.add(Histogram::now() - start);
+   blockswritten.add(ok ? blocknumbers.size() : 0);
+   return ok;
+}
+int Sdisk::locate(int blocknumber, off_t& offset)
+{
+   if(fds.size() == 1)
+   {
+      offset = (off_t)blocknumber * blocksize;
+      return fds[0];
+   }
+   int unit = blocknumber / chunk;
+   int stripes = fds.size();
+   offset = ((off_t)(unit / stripes) * chunk + blocknumber % chunk) * blocksize;
+   return fds[unit % stripes];
+}
+int Sdisk::transfer(const vector<int>& blocknumbers, const vector<char*>& data, bool write)
+{
+   //runs of consecutive block numbers inside one chunk go to the disk as
+   //one preadv or pwritev; each file's runs go in order on a thread of
+   //its own when the batch touches more than one file. Direct runs are
+   //a slab long at most and go through one. A mirrored write sends every
+   //run to every replica; a mirrored read deals its runs out to the
+   //replicas by load.
+   int longest = direct ? slabblocks : IOV_MAX;
+   vector<vector<pair<int,int> > > runs(fds.size()); //first index and length
+   for(int i = 0; i < blocknumbers.size(); )
+   {
+      int b = blocknumbers[i];
+      if(b < 0 || b >= numberofblocks)
+      {
+         return 0;
+      }
+      int run = 1;
+      while(i + run < blocknumbers.size() && run < longest
+            && blocknumbers[i + run] == b + run && (b + run) % chunk != 0)
+      {
+         run++;
+      }
+      runs[(b / chunk) % fds.size()].push_back(make_pair(i, run));
+      i += run;
+   }
+   vector<int> load(fds.size(), 0); //blocks this batch puts on each replica
+   if(mirrored)
+   {
+      vector<pair<int,int> > all;
+      all.swap(runs[0]);
+      int replicas = fds.size();
+      const int shortest = 8; //a read run is split across replicas down to this
+      for(int r = 0; r < all.size(); r++)
+      {
+         int i = all[r].first;
+         int run = all[r].second;
+         if(write)
+         {
+            for(int s = 0; s < replicas; s++)
+            {
+               runs[s].push_back(all[r]);
+               load[s] += run;
+            }
+            continue;
+         }
+         int piece = max(shortest, (run + replicas - 1) / replicas);
+         for(int j = 0; j < run; j += piece)
+         {
+            int s = 0;
+            for(int t = 1; t < replicas; t++)
+            {
+               if(depth[t] + load[t] < depth[s] + load[s])
+               {
+                  s = t;
+               }
+            }
+            runs[s].push_back(make_pair(i + j, min(piece, run - j)));
+            load[s] += min(piece, run - j);
+         }
+      }
+      for(int s = 0; s < replicas; s++)
+      {
+         depth[s] += load[s];
+      }
+   }
+   vector<char> ok(fds.size(), 1);
+   auto stripe = [&](int s)
+   {
+      for(int r = 0; r < runs[s].size(); r++)
+      {
+         int i = runs[s][r].first;
+         int run = runs[s][r].second;
+         off_t offset;
+         locate(blocknumbers[i], offset);
+         int fd = fds[s]; //the file locate names, or this replica
+         if(direct)
+         {
+            char* slab = take();
+            if(slab == NULL)
+            {
+               ok[s] = 0;
+               continue;
+            }
+            for(int j = 0; write && j < run; j++)
+            {
+               memcpy(slab + (size_t)j * blocksize, data[i + j], blocksize);
+            }
+            ssize_t n = write ? pwrite(fd, slab, (size_t)run * blocksize, offset)
+                              : pread(fd, slab, (size_t)run * blocksize, offset);
+            for(int j = 0; !write && j < run; j++)
+            {
+               memcpy(data[i + j], slab + (size_t)j * blocksize, blocksize);
+            }
+            give(slab);
+            if(n != (ssize_t)run * blocksize)
+            {
+               ok[s] = 0;
+            }
+            continue;
+         }
+         vector<iovec> iov(run);
+         for(int j = 0; j < run; j++)
+         {
+            iov[j].iov_base = data[i + j];
+            iov[j].iov_len = blocksize;
+         }
+         ssize_t n = write ? pwritev(fd, &iov[0], run, offset) : preadv(fd, &iov[0], run, offset);
+         if(n != (ssize_t)run * blocksize)
+         {
+            ok[s] = 0;
+         }
+      }
+   };
+   vector<thread> workers;
+   int mine = -1;
+   for(int s = 0; s < fds.size(); s++)
+   {
+      if(runs[s].empty())
+      {
+         continue;
+      }
+      if(mine < 0)
+      {
+         mine = s; //this thread takes the first file itself
+      }
+      else
+      {
+         workers.push_back(thread(stripe, s));
+      }
+   }
+   if(mine >= 0)
+   {
+      stripe(mine);
+   }
+   for(int w = 0; w < workers.size(); w++)
+   {
+      workers[w].join();
+   }
+   if(mirrored)
+   {
+      for(int s = 0; s < fds.size(); s++)
+      {
+         depth[s] -= load[s];
+      }
+      for(int r = 0; !write && r < runs.size(); r++)
+      {
+         //every block read is checked; a bad or unread one comes from
+         //the other replicas instead
+         for(int k = 0; k < runs[r].size(); k++)
+         {
+            for(int i = runs[r][k].first; i < runs[r][k].first + runs[r][k].second; i++)
+            {
+               if((!ok[r] || !verify(blocknumbers[i], data[i])) && fallback(blocknumbers[i], data[i]) == 0)
+               {
+                  return 0;
+               }
+            }
+         }
+         ok[r] = 1;
+      }
+      for(int i = 0; write && i < blocknumbers.size(); i++)
+      {
+         summarize(blocknumbers[i], data[i]);
+      }
+   }
+   for(int s = 0; s < fds.size(); s++)
+   {
+      if(!ok[s])
+      {
+         return 0;
+      }
+   }
+   return 1;
+}
+int Sdisk::settrim(bool on)
+{
+   if(on == trimming)
+   {
+      return 1;
+   }
+   if(on)
+   {
+      trimstop = false;
+      trimming = true;
+      trimmer = thread(&Sdisk::trimloop, this);
+   }
    else
    {
-      return 0; //failure
+      {
+         lock_guard<mutex> tl(trimlock);
+         trimstop = true; //staged blocks are dropped, queued ones still go
+      }
+      trimwake.notify_all();
+      trimmer.join();
+      trimming = false;
+      staged.clear();
+      held.clear();
+   }
+   return 1;
+}
+bool Sdisk::gettrim()
+{
+   return trimming;
+}
+int Sdisk::discard(const vector<int>& blocknumbers, bool later)
+{
+   if(!discarding())
+   {
+      return 0;
+   }
+   lock_guard<mutex> tl(trimlock);
+   for(int i = 0; i < blocknumbers.size(); i++)
+   {
+      int b = blocknumbers[i];
+      if(b >= 0 && b < numberofblocks)
+      {
+         pending[b] = 1;
+         (later ? held : staged).push_back(b);
+      }
+   }
+   return 1;
+}
+int Sdisk::trimcommit()
+{
+   if(!discarding())
+   {
+      return 0;
+   }
+   {
+      lock_guard<mutex> tl(trimlock);
+      if(zdisk != NULL)
+      {
+         for(int i = 0; i < staged.size(); i++)
+         {
+            if(pending[staged[i]])
+            {
+               zdisk->drop(staged[i]); //its log record is dead now
+               pending[staged[i]] = trimming ? 1 : 0;
+            }
+         }
+      }
+      if(trimming)
+      {
+         queued.insert(queued.end(), staged.begin(), staged.end());
+      }
+      staged.swap(held);
+      held.clear();
+   }
+   trimwake.notify_all();
+   return 1;
+}
+int Sdisk::trimwait()
+{
+   if(!trimming)
+   {
+      return 0;
+   }
+   unique_lock<mutex> tl(trimlock);
+   trimdone.wait(tl, [this]() { return queued.empty() && !trimbusy; });
+   return 1;
+}
+void Sdisk::cancel(int blocknumber)
+{
+   //the punch holds trimlock, so a write to a pending block waits for it
+   //to finish or takes the block off the list before it starts
+   if(pending[blocknumber])
+   {
+      lock_guard<mutex> tl(trimlock);
+      pending[blocknumber] = 0;
+   }
+   if(holes[blocknumber])
+   {
+      holes[blocknumber] = 0; //holds data again once this write lands
+   }
+}
+void Sdisk::unhole(int blocknumber, char* data)
+{
+   //only blocks this Sdisk punched; a block written as NULs stays NULs
+   if(blocknumber >= 0 && blocknumber < numberofblocks && holes[blocknumber])
+   {
+      memset(data, '#', blocksize);
+   }
+}
+void Sdisk::trimloop()
+{
+   unique_lock<mutex> tl(trimlock);
+   while(true)
+   {
+      trimwake.wait(tl, [this]() { return trimstop || !queued.empty(); });
+      if(queued.empty())
+      {
+         break; //stopping and nothing left
+      }
+      //give neighbours a moment to arrive so runs coalesce
+      trimbusy = true;
+      tl.unlock();
+      this_thread::sleep_for(chrono::milliseconds(5));
+      tl.lock();
+      vector<int> work;
+      work.swap(queued);
+      sort(work.begin(), work.end());
+      for(int i = 0; i < work.size(); )
+      {
+         int run = 0;
+         while(i + run < work.size() && work[i + run] == work[i] + run && pending[work[i + run]])
+         {
+            run++;
+         }
+         if(run == 0)
+         {
+            i++; //rewritten since it was freed, or a duplicate
+            continue;
+         }
+         for(int j = 0; j < run; )
+         {
+            int piece = chunk - work[i + j] % chunk; //a run may cross into the next file
+            if(piece > run - j)
+            {
+               piece = run - j;
+            }
+            off_t offset;
+            int fd = locate(work[i + j], offset);
+            int punched = 1;
+            for(int s = 0; s < (mirrored ? fds.size() : 1); s++)
+            {
+               if(fallocate(mirrored ? fds[s] : fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                            offset, (off_t)piece * blocksize) != 0)
+               {
+                  punched = 0;
+               }
+            }
+            for(int k = j; punched && k < j + piece; k++)
+            {
+               holes[work[i + k]] = 1;
+               if(mirrored)
+               {
+                  sums[work[i + k]] = holesum; //reads back as zeros now
+                  sumdirty[work[i + k] / sumpage] = 1;
+               }
+            }
+            j += piece;
+         }
+         for(int j = 0; j < run; j++)
+         {
+            pending[work[i + j]] = 0;
+         }
+         i += run;
+      }
+      trimbusy = false;
+      trimdone.notify_all();
+   }
+   trimdone.notify_all();
+}
+bool Sdisk::discarding()
+{
+   return trimming || zdisk != NULL;
+}
+int Sdisk::setcompress(bool on)
+{
+   if(on && fds.size() > 1)
+   {
+      cout << "Compression needs a disk of one file" << endl;
+      return 0;
+   }
+   if(on && direct)
+   {
+      cout << "Compression does not work with direct I/O" << endl;
+      return 0;
+   }
+   if(on && zdisk == NULL)
+   {
+      zdisk = new Zdisk(diskname, numberofblocks, blocksize);
+      zdisk->sync();
+   }
+   else if(!on && zdisk != NULL)
+   {
+      //put every block the log holds back into the plain image
+      Zdisk* z = zdisk;
+      string buffer(blocksize, '#');
+      for(int b = 0; b < numberofblocks; b++)
+      {
+         if(z->stored(b) && z->getblock(b, &buffer[0]) == 1)
+         {
+            pwrite(fds[0], buffer.data(), blocksize, (off_t)b * blocksize);
+         }
+      }
+      fdatasync(fds[0]);
+      zdisk = NULL;
+      z->erase();
+      delete z;
+   }
+   return 1;
+}
+int Sdisk::setdedup(bool on)
+{
+   if(zdisk == NULL)
+   {
+      if(!on)
+      {
+         return 1;
+      }
+      if(setcompress(true) == 0) //sharing needs a block map under the FAT
+      {
+         return 0;
+      }
+   }
+   zdisk->setdedup(on);
+   return zdisk->sync();
+}
+string Sdisk::compressstats()
+{
+   if(zdisk == NULL)
+   {
+      return "compression is off";
+   }
+   return zdisk->stats();
+}
+int Sdisk::setdirect(bool on)
+{
+   if(on == direct)
+   {
+      return 1;
+   }
+   if(on && (zdisk != NULL || blocksize % 512 != 0))
+   {
+      cout << "Direct I/O needs an uncompressed disk and a block size that is a multiple of 512" << endl;
+      return 0;
+   }
+   for(int s = 0; s < fds.size(); s++)
+   {
+      int flags = fcntl(fds[s], F_GETFL);
+      fcntl(fds[s], F_SETFL, on ? flags | O_DIRECT : flags & ~O_DIRECT);
+   }
+   direct = on;
+   if(on)
+   {
+      //the host file system may refuse direct I/O, or this alignment
+      char* slab = take();
+      bool ok = slab != NULL;
+      for(int s = 0; ok && s < fds.size(); s++)
+      {
+         ok = pread(fds[s], slab, blocksize, 0) == blocksize;
+      }
+      if(slab != NULL)
+      {
+         give(slab);
+      }
+      if(!ok)
+      {
+         setdirect(false);
+         cout << "Direct I/O is not supported for " << diskname << endl;
+         return 0;
+      }
+   }
+   return 1;
+}
+bool Sdisk::getdirect()
+{
+   return direct;
+}
+char* Sdisk::take()
+{
+   {
+      lock_guard<mutex> sl(slablock);
+      if(!slabs.empty())
+      {
+         char* slab = slabs.back();
+         slabs.pop_back();
+         return slab;
+      }
+   }
+   void* slab = NULL;
+   if(posix_memalign(&slab, 4096, (size_t)slabblocks * blocksize) != 0)
+   {
+      return NULL;
+   }
+   return (char*)slab;
+}
+void Sdisk::give(char* slab)
+{
+   lock_guard<mutex> sl(slablock);
+   slabs.push_back(slab);
+}
+int Sdisk::sync()
+{
+   if(zdisk != NULL)
+   {
+      return zdisk->sync();
+   }
+   int ok = 1;
+   for(int s = 0; s < fds.size(); s++)
+   {
+      if(fdatasync(fds[s]) != 0)
+      {
+         ok = 0;
+      }
+   }
+   if(mirrored && savesums() == 0)
+   {
+      ok = 0;
+   }
+   return ok;
+}
+string Sdisk::stats(bool json)
+{
+   long long reads = blocksread.value();
+   long long writes = blockswritten.value();
+   ostringstream out;
+   if(json)
+   {
+      out << "{\"blocks_read\":" << reads << ",\"blocks_written\":" << writes
+          << ",\"bytes_read\":" << reads * blocksize << ",\"bytes_written\":" << writes * blocksize
+          << ",\"read_ns\":" << readtime.json() << ",\"write_ns\":" << writetime.json();
+      if(mirrored)
+      {
+         out << ",\"repairs\":" << repairs.value();
+      }
+      out << "}";
+   }
+   else
+   {
+      out << "blocks read      " << reads << " (" << reads * blocksize << " bytes)" << endl
+          << "blocks written   " << writes << " (" << writes * blocksize << " bytes)" << endl
+          << "read calls       " << readtime.text() << endl
+          << "write calls      " << writetime.text() << endl;
+      if(mirrored)
+      {
+         out << "blocks repaired  " << repairs.value() << endl;
+      }
+   }
+   return out.str();
+}
+void Sdisk::resetstats()
+{
+   blocksread.reset();
+   blockswritten.reset();
+   readtime.reset();
+   writetime.reset();
+   repairs.reset();
+}
+const char* Sdisk::map(int blocknumber, int count, void*& base, size_t& length)
+{
+   //compressed blocks are not where the image says, mirrored ones must
+   //pass their checksums, and a striped run must not cross a chunk
+   base = NULL;
+   length = 0;
+   if(zdisk != NULL || mirrored || count <= 0 || blocknumber < 0 || blocknumber + count > numberofblocks
+      || blocknumber / chunk != (blocknumber + count - 1) / chunk)
+   {
+      return NULL;
+   }
+   off_t offset;
+   int fd = locate(blocknumber, offset);
+   off_t page = sysconf(_SC_PAGESIZE);
+   off_t first = offset - offset % page; //mmap starts on a page
+   size_t size = offset - first + (size_t)count * blocksize;
+   void* m = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, first);
+   if(m == MAP_FAILED)
+   {
+      return NULL;
+   }
+   madvise(m, size, MADV_SEQUENTIAL);
+   base = m;
+   length = size;
+   return (const char*)m + (offset - first);
+}
+int Sdisk::quietest()
+{
+   int replicas = fds.size();
+   int best = turn++ % replicas; //idle replicas take single reads in turn
+   for(int t = 1; t < replicas; t++)
+   {
+      int s = (best + t) % replicas;
+      if(depth[s] < depth[best])
+      {
+         best = s;
+      }
+   }
+   return best;
+}
+bool Sdisk::verify(int blocknumber, const char* data)
+{
+   return (unsigned int)blockhash(data, blocksize) == sums[blocknumber];
+}
+void Sdisk::summarize(int blocknumber, const char* data)
+{
+   sums[blocknumber] = (unsigned int)blockhash(data, blocksize);
+   sumdirty[blocknumber / sumpage] = 1;
+}
+int Sdisk::fallback(int blocknumber, char* buffer)
+{
+   //the first replica whose copy matches the checksum is good and is
+   //written over the rest. If none matches, the checksum is what went
+   //stale (a crash between a write and the next save), so the first
+   //readable copy is kept and the others made to agree with it.
+   lock_guard<mutex> rl(repairlock);
+   repairs.add(1);
+   off_t offset;
+   locate(blocknumber, offset);
+   char* copy = take(); //aligned, for direct I/O
+   if(copy == NULL)
+   {
+      cout << "Block " << blocknumber << " of " << diskname << " cannot be repaired: out of memory" << endl;
+      return 0;
+   }
+   vector<char> good(fds.size(), 0);
+   int found = -1;
+   int readable = -1;
+   for(int s = 0; s < fds.size(); s++)
+   {
+      if(pread(fds[s], copy, blocksize, offset) != blocksize)
+      {
+         continue;
+      }
+      if(found < 0 && verify(blocknumber, copy))
+      {
+         memcpy(buffer, copy, blocksize);
+         found = s;
+         good[s] = 1;
+      }
+      else if(found < 0 && readable < 0)
+      {
+         memcpy(buffer, copy, blocksize);
+         readable = s;
+      }
+      else if(found >= 0 && verify(blocknumber, copy))
+      {
+         good[s] = 1;
+      }
+   }
+   if(found < 0 && readable < 0)
+   {
+      give(copy);
+      cout << "Block " << blocknumber << " cannot be read from any replica of " << diskname << endl;
+      return 0;
+   }
+   if(found < 0)
+   {
+      cout << "No replica of block " << blocknumber << " of " << diskname
+           << " matches its checksum; keeping replica " << readable << endl;
+      summarize(blocknumber, buffer);
+      good[readable] = 1;
+   }
+   memcpy(copy, buffer, blocksize);
+   for(int s = 0; s < fds.size(); s++)
+   {
+      if(!good[s])
+      {
+         pwrite(fds[s], copy, blocksize, offset);
+      }
+   }
+   give(copy);
+   return 1;
+}
+int Sdisk::savesums()
+{
+   vector<unsigned int> page(sumpage);
+   bool saved = false;
+   int ok = 1;
+   for(int p = 0; p < sumdirty.size(); p++)
+   {
+      if(!sumdirty[p])
+      {
+         continue;
+      }
+      sumdirty[p] = 0; //a change from here on marks it again
+      int first = p * sumpage;
+      int count = min((int)sumpage, numberofblocks - first);
+      for(int k = 0; k < count; k++)
+      {
+         page[k] = sums[first + k];
+      }
+      ssize_t length = (ssize_t)count * sizeof(unsigned int);
+      if(pwrite(sumfd, &page[0], length, (off_t)first * sizeof(unsigned int)) != length)
+      {
+         ok = 0;
+      }
+      saved = true;
+   }
+   if(saved && fdatasync(sumfd) != 0)
+   {
+      ok = 0;
    }
+   return ok;
 }
 int Sdisk::getnumberofblocks()
 {
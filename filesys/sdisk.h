@@ -1,19 +1,115 @@
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <string_view>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <sys/types.h>
+#include "stats.h"
 
 using namespace std;
 
+class Zdisk;
+
+// A disk is one host file, or several with blocks striped across them
+// chunk at a time: block b lives in file (b / chunk) % files. Batched
+// reads and writes touching several files go to them in parallel.
+//
+// With chunk == mirror the files are instead whole replicas of the disk.
+// A write goes to every replica at once; a read goes to the replica with
+// the fewest blocks in flight and is checked against a checksum kept in
+// diskname.sums. A block that fails its check is read from the other
+// replicas and the bad copies are rewritten.
 class Sdisk
 {
 public:
+   static const int mirror = 0; // chunk that makes the files replicas
    Sdisk(string diskname, int numberofblocks, int blocksize);
-   int getblock(int blocknumber, string& buffer);
-   int putblock(int blocknumber, string buffer);
+   Sdisk(const vector<string>& disknames, int numberofblocks, int blocksize, int chunk); // striped or mirrored
+   ~Sdisk();
+   int getblock(int blocknumber, string& buffer); // appends the block to buffer
+   int getblock(int blocknumber, char* buffer);   // fills blocksize bytes at buffer
+   int putblock(int blocknumber, string_view buffer); // short buffers are padded with '#'
+   int getblocks(const vector<int>& blocknumbers, vector<string>& buffers);
+   int getblocks(const vector<int>& blocknumbers, char* buffer); // blocksize bytes each, back to back at buffer
+   int putblocks(const vector<int>& blocknumbers, const vector<string>& buffers);
+   int putblocks(const vector<int>& blocknumbers, const vector<string_view>& buffers);
+   template<int Blocksize> int getfixed(int blocknumber, char* buffer); // getblock for a compile-time size, see fixedfs.h
+   template<int Blocksize> int putfixed(int blocknumber, const char* buffer); // putblock of a whole block
    int getnumberofblocks(); // accessor function
    int getblocksize(); // accessor function
+   int settrim(bool on);   // punch holes in the image for discarded blocks
+   bool gettrim();
+   int discard(const vector<int>& blocknumbers, bool later = false); // stages blocks to be punched, later ones
+                           // wait for one more trimcommit
+   int trimcommit();       // hands staged blocks to the trim thread; held ones become staged
+   int trimwait();         // waits until every handed block is punched
+   bool discarding();      // freed blocks are worth passing to discard
+   int setcompress(bool on); // routes blocks through a Zdisk; call while idle; one file only
+   int setdedup(bool on);  // stores identical blocks once; turns compression on
+   string compressstats();
+   int setdirect(bool on); // O_DIRECT I/O past the host page cache; call while idle
+   bool getdirect();
+   int sync();             // makes everything written so far durable
+   const char* map(int blocknumber, int count, void*& base, size_t& length); // count blocks mapped in place, NULL
+                           // unless they sit in one plain file; munmap(base, length) when done
+   string stats(bool json); // block I/O counters and latencies
+   void resetstats();
 private:
+   void attach(const vector<string>& disknames, int chunk); // opens or creates the files
+   int locate(int blocknumber, off_t& offset); // descriptor and byte offset of blocknumber
+   template<int Blocksize> int place(int blocknumber, off_t& offset); // locate with shifts
+   int transfer(const vector<int>& blocknumbers, const vector<char*>& data, bool write);
+   int readone(int blocknumber, char* buffer);       // getblock without the counting
+   int writeone(int blocknumber, string_view buffer); // putblock without the counting
+   char* take();                 // an aligned slab of slabblocks blocks from the pool, NULL if out of memory
+   void give(char* slab);        // back to the pool
+   void cancel(int blocknumber); // a write to blocknumber wins over its punch
+   void unhole(int blocknumber, char* data); // a punched block reads back as '#' fill
+   void trimloop();              // body of the trim thread
+   int quietest();               // replica with the fewest blocks in flight
+   bool verify(int blocknumber, const char* data);  // data matches the block's checksum
+   void summarize(int blocknumber, const char* data); // data is the block's contents now
+   int fallback(int blocknumber, char* buffer);     // a good copy from any replica, repairing the rest
+   int savesums();               // writes out the checksum pages changed since the last save
    string diskname;        // file name of software-disk
    int numberofblocks;     // number of blocks on disk
    int blocksize;          // block size in bytes
+   vector<int> fds;        // one descriptor per file, shared by all threads (pread/pwrite)
+   int chunk;              // consecutive blocks kept in one file before the next takes over
+   string padding;         // blocksize '#', written after a short buffer instead of copying it
+   atomic<bool> trimming;  // discard mode is on
+   vector<atomic<char> > pending; // block is held, staged or queued to be punched
+   vector<atomic<char> > holes; // block was punched and not written since
+   vector<int> staged;     // discarded, waiting for the metadata that frees them
+   vector<int> held;       // discarded, freed by metadata not yet written
+   vector<int> queued;     // ready for the trim thread
+   bool trimstop;          // trim thread should drain and exit
+   bool trimbusy;          // trim thread is punching
+   mutex trimlock;         // staged, queued, and every punch in progress
+   condition_variable trimwake;
+   condition_variable trimdone;
+   thread trimmer;
+   Zdisk* zdisk;           // compressed store, NULL when off
+   atomic<bool> direct;    // files are open O_DIRECT; I/O goes through slabs
+   vector<char*> slabs;    // free aligned buffers for direct I/O
+   mutex slablock;         // slabs
+   static const int slabblocks = 64; // blocks per slab, and the longest direct run
+   bool mirrored;          // every file holds every block
+   vector<atomic<unsigned int> > sums; // checksum of each block, mirrored only
+   vector<atomic<char> > sumdirty;    // page of sums changed since the last save
+   static const int sumpage = 1024;   // sums per page of diskname.sums
+   int sumfd;              // diskname.sums, -1 unless mirrored
+   unsigned int holesum;   // checksum of a punched block
+   vector<atomic<int> > depth; // blocks in flight on each replica
+   atomic<unsigned int> turn;  // breaks ties between idle replicas in turn
+   mutex repairlock;       // one fallback at a time
+   Counter repairs;        // blocks that failed their check
+   Counter blocksread;     // blocks read, one by one or in batches
+   Counter blockswritten;
+   Histogram readtime;     // per getblock or getblocks call
+   Histogram writetime;    // per putblock or putblocks call
 };
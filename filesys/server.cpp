@@ -0,0 +1,524 @@
+#include "sdisk.h"
+#include "filesys.h"
+#include "server.h"
+#include <cstring>
+#include <cstdint>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static const uint32_t maxframe = 64 << 20; //longer frames mean a confused client
+
+static bool readall(int fd, char* data, size_t length)
+{
+   while(length > 0)
+   {
+      ssize_t n = read(fd, data, length);
+      if(n <= 0)
+      {
+         return false;
+      }
+      data += n;
+      length -= n;
+   }
+   return true;
+}
+static bool writeall(int fd, const char* data, size_t length)
+{
+   while(length > 0)
+   {
+      ssize_t n = send(fd, data, length, MSG_NOSIGNAL); //a vanished peer is an error, not a signal
+      if(n <= 0)
+      {
+         return false;
+      }
+      data += n;
+      length -= n;
+   }
+   return true;
+}
+static void frame(string& out, const Message& message)
+{
+   //appends message with its length in front
+   uint32_t length = message.data.size();
+   out.append((const char*)&length, 4);
+   out += message.data;
+}
+static sockaddr_un address(string socketpath)
+{
+   sockaddr_un a;
+   memset(&a, 0, sizeof(a));
+   a.sun_family = AF_UNIX;
+   strncpy(a.sun_path, socketpath.c_str(), sizeof(a.sun_path) - 1);
+   return a;
+}
+
+Message::Message()
+{
+   at = 0;
+}
+void Message::putint(int n)
+{
+   data.append((const char*)&n, 4);
+}
+void Message::putstring(string_view s)
+{
+   putint(s.size());
+   data.append(s.data(), s.size());
+}
+bool Message::getint(int& n)
+{
+   if(data.size() - at < 4)
+   {
+      return false;
+   }
+   memcpy(&n, &data[at], 4);
+   at += 4;
+   return true;
+}
+bool Message::getstring(string& s)
+{
+   int length;
+   if(!getint(length) || length < 0 || data.size() - at < length)
+   {
+      return false;
+   }
+   s.assign(data, at, length);
+   at += length;
+   return true;
+}
+
+Server::Server(Filesys& fsys, string socketpath): fsys(fsys)
+{
+   this->socketpath = socketpath;
+   listener = -1;
+   stopping = false;
+   active = 0;
+   requested = 0;
+   done = 0;
+   committing = false;
+   fsys.startbatch(); //changes wait for commit(), never commit one by one
+}
+Server::~Server()
+{
+   fsys.endbatch(); //anything not yet committed goes out now
+   fsys.fsbarrier(); //and its superblock is durable before we exit
+}
+int Server::run()
+{
+   listener = socket(AF_UNIX, SOCK_STREAM, 0);
+   sockaddr_un a = address(socketpath);
+   unlink(socketpath.c_str()); //left behind by a server that did not stop cleanly
+   if(listener < 0 || bind(listener, (sockaddr*)&a, sizeof(a)) != 0 || listen(listener, 64) != 0)
+   {
+      cout << "Cannot listen on " << socketpath << endl;
+      if(listener >= 0)
+      {
+         close(listener);
+      }
+      return 0;
+   }
+   while(!stopping)
+   {
+      pollfd p;
+      p.fd = listener;
+      p.events = POLLIN;
+      if(poll(&p, 1, 200) <= 0) //wakes now and then to notice stop()
+      {
+         continue;
+      }
+      int client = accept(listener, NULL, NULL);
+      if(client < 0)
+      {
+         continue;
+      }
+      lock_guard<mutex> cl(clientlock);
+      clients.push_back(client);
+      active++;
+      thread(&Server::serve, this, client).detach();
+   }
+   {
+      //unblock every connection's read, then wait for them to finish
+      unique_lock<mutex> cl(clientlock);
+      for(int i = 0; i < clients.size(); i++)
+      {
+         shutdown(clients[i], SHUT_RDWR);
+      }
+      idle.wait(cl, [this]() { return active == 0; });
+   }
+   close(listener);
+   unlink(socketpath.c_str());
+   return 1;
+}
+void Server::stop()
+{
+   stopping = true;
+}
+void Server::serve(int client)
+{
+   string pending; //bytes read that do not yet make a whole frame
+   string out;     //replies held back until the commit
+   vector<char> chunk(1 << 16);
+   bool open = true;
+   while(open)
+   {
+      ssize_t n = read(client, &chunk[0], chunk.size());
+      if(n <= 0)
+      {
+         break;
+      }
+      pending.append(&chunk[0], n);
+      //run every whole request that has arrived, then commit once for all
+      bool changed = false;
+      size_t start = 0;
+      while(pending.size() - start >= 4)
+      {
+         uint32_t length;
+         memcpy(&length, &pending[start], 4);
+         if(length < 5 || length > maxframe)
+         {
+            open = false;
+            break;
+         }
+         if(pending.size() - start - 4 < length)
+         {
+            break;
+         }
+         Message request;
+         request.data.assign(pending, start + 4, length);
+         Message reply;
+         changed |= execute(request, reply);
+         frame(out, reply);
+         start += 4 + length;
+      }
+      pending.erase(0, start);
+      if(changed)
+      {
+         commit();
+      }
+      if(!writeall(client, out.data(), out.size()))
+      {
+         break;
+      }
+      out.clear();
+   }
+   lock_guard<mutex> cl(clientlock);
+   for(int i = 0; i < clients.size(); i++)
+   {
+      if(clients[i] == client)
+      {
+         clients.erase(clients.begin() + i);
+         break;
+      }
+   }
+   close(client);
+   if(--active == 0)
+   {
+      idle.notify_all();
+   }
+}
+bool Server::execute(Message& request, Message& reply)
+{
+   int id = 0;
+   bool ok = request.getint(id) && request.at < request.data.size();
+   int op = ok ? (unsigned char)request.data[request.at++] : 0;
+   string file;
+   string block;
+   int blocknumber = 0;
+   if(op != LS && op != SYNC)
+   {
+      ok = ok && request.getstring(file);
+   }
+   if(op == DELBLOCK || op == READBLOCK || op == WRITEBLOCK || op == NEXTBLOCK)
+   {
+      ok = ok && request.getint(blocknumber);
+   }
+   if(op == ADDBLOCK || op == WRITEBLOCK)
+   {
+      ok = ok && request.getstring(block);
+   }
+   reply.putint(id);
+   if(!ok)
+   {
+      reply.putint(-1); //malformed
+      return false;
+   }
+   switch(op)
+   {
+      case NEWFILE:
+         reply.putint(fsys.newfile(file));
+         return true;
+      case RMFILE:
+         reply.putint(fsys.rmfile(file));
+         return true;
+      case GETFIRSTBLOCK:
+         reply.putint(fsys.getfirstblock(file));
+         return false;
+      case ADDBLOCK:
+         reply.putint(fsys.addblock(file, block));
+         return true;
+      case DELBLOCK:
+         reply.putint(fsys.delblock(file, blocknumber));
+         return true;
+      case READBLOCK:
+      {
+         block.resize(fsys.getblocksize());
+         int result = fsys.readblock(file, blocknumber, &block[0]);
+         reply.putint(result);
+         if(result == 1)
+         {
+            reply.putstring(block);
+         }
+         return false;
+      }
+      case WRITEBLOCK:
+         reply.putint(fsys.writeblock(file, blocknumber, block));
+         return true;
+      case NEXTBLOCK:
+         reply.putint(fsys.nextblock(file, blocknumber));
+         return false;
+      case LS:
+      {
+         vector<string> names = fsys.ls();
+         reply.putint(names.size());
+         for(int i = 0; i < names.size(); i++)
+         {
+            reply.putstring(names[i]);
+         }
+         return false;
+      }
+      case SYNC:
+         reply.putint(1);
+         return true;
+   }
+   reply.putint(-1); //unknown op
+   return false;
+}
+void Server::commit()
+{
+   //group commit: whoever finds no commit running writes one for every
+   //change made so far; the rest wait for it, or for the one after it
+   //if theirs came in too late to be in its snapshot
+   unique_lock<mutex> cm(commitlock);
+   long long mine = ++requested;
+   while(done < mine)
+   {
+      if(committing)
+      {
+         committed.wait(cm);
+         continue;
+      }
+      committing = true;
+      long long upto = requested;
+      cm.unlock();
+      fsys.fssynch();
+      fsys.fsbarrier(); //replies promise the superblock too
+      cm.lock();
+      committing = false;
+      done = upto;
+      committed.notify_all();
+   }
+}
+
+Client::Client(string socketpath)
+{
+   nextid = 0;
+   fd = socket(AF_UNIX, SOCK_STREAM, 0);
+   sockaddr_un a = address(socketpath);
+   if(fd >= 0 && connect(fd, (sockaddr*)&a, sizeof(a)) != 0)
+   {
+      close(fd);
+      fd = -1;
+   }
+   if(fd < 0)
+   {
+      cout << "Cannot connect to " << socketpath << endl;
+   }
+}
+Client::~Client()
+{
+   if(fd >= 0)
+   {
+      close(fd);
+   }
+}
+bool Client::connected()
+{
+   return fd >= 0;
+}
+int Client::send(int op, Message& request)
+{
+   if(fd < 0)
+   {
+      return -1;
+   }
+   Message head;
+   int id = nextid++;
+   head.putint(id);
+   head.data += (char)op;
+   head.data += request.data;
+   string out;
+   frame(out, head);
+   if(!writeall(fd, out.data(), out.size()))
+   {
+      return -1;
+   }
+   return id;
+}
+int Client::receive(Message& reply)
+{
+   uint32_t length;
+   reply.data.clear();
+   reply.at = 0;
+   if(fd < 0 || !readall(fd, (char*)&length, 4) || length < 8 || length > maxframe)
+   {
+      return -1;
+   }
+   reply.data.resize(length);
+   if(!readall(fd, &reply.data[0], length))
+   {
+      return -1;
+   }
+   int id = 0;
+   int status = -1;
+   if(!reply.getint(id) || !reply.getint(status))
+   {
+      return -1;
+   }
+   return status;
+}
+int Client::call(int op, Message& request, Message& reply)
+{
+   if(send(op, request) < 0)
+   {
+      return -1;
+   }
+   return receive(reply);
+}
+int Client::newfile(string file)
+{
+   Message request;
+   Message reply;
+   request.putstring(file);
+   return call(NEWFILE, request, reply);
+}
+int Client::rmfile(string file)
+{
+   Message request;
+   Message reply;
+   request.putstring(file);
+   return call(RMFILE, request, reply);
+}
+int Client::getfirstblock(string file)
+{
+   Message request;
+   Message reply;
+   request.putstring(file);
+   return call(GETFIRSTBLOCK, request, reply);
+}
+int Client::addblock(string file, string_view block)
+{
+   Message request;
+   Message reply;
+   request.putstring(file);
+   request.putstring(block);
+   return call(ADDBLOCK, request, reply);
+}
+int Client::addblocks(string file, const vector<string_view>& blocks)
+{
+   //a window of requests goes out before its first reply is read, so
+   //the server runs them as one burst with one commit; the window keeps
+   //unread replies from filling the socket while requests still go out
+   int added = 0;
+   for(int first = 0; first < blocks.size(); first += window)
+   {
+      int sent = 0;
+      for(int i = first; i < blocks.size() && i < first + window; i++)
+      {
+         Message request;
+         request.putstring(file);
+         request.putstring(blocks[i]);
+         if(send(ADDBLOCK, request) < 0)
+         {
+            break;
+         }
+         sent++;
+      }
+      for(int i = 0; i < sent; i++)
+      {
+         Message reply;
+         if(receive(reply) == 1)
+         {
+            added++;
+         }
+      }
+      if(sent < window && first + sent < blocks.size())
+      {
+         break; //the server went away
+      }
+   }
+   return added;
+}
+int Client::delblock(string file, int blocknumber)
+{
+   Message request;
+   Message reply;
+   request.putstring(file);
+   request.putint(blocknumber);
+   return call(DELBLOCK, request, reply);
+}
+int Client::readblock(string file, int blocknumber, string& buffer)
+{
+   Message request;
+   Message reply;
+   request.putstring(file);
+   request.putint(blocknumber);
+   int result = call(READBLOCK, request, reply);
+   string block;
+   if(result == 1 && reply.getstring(block))
+   {
+      buffer += block;
+   }
+   return result;
+}
+int Client::writeblock(string file, int blocknumber, string_view block)
+{
+   Message request;
+   Message reply;
+   request.putstring(file);
+   request.putint(blocknumber);
+   request.putstring(block);
+   return call(WRITEBLOCK, request, reply);
+}
+int Client::nextblock(string file, int blocknumber)
+{
+   Message request;
+   Message reply;
+   request.putstring(file);
+   request.putint(blocknumber);
+   return call(NEXTBLOCK, request, reply);
+}
+vector<string> Client::ls()
+{
+   Message request;
+   Message reply;
+   vector<string> names;
+   int count = call(LS, request, reply);
+   for(int i = 0; i < count; i++)
+   {
+      string name;
+      if(!reply.getstring(name))
+      {
+         break;
+      }
+      names.push_back(name);
+   }
+   return names;
+}
+int Client::fssynch()
+{
+   Message request;
+   Message reply;
+   return call(SYNC, request, reply);
+}
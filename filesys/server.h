@@ -0,0 +1,103 @@
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+using namespace std;
+
+// One process owns a mounted Filesys and serves it to local clients over
+// a Unix domain socket, so the FAT is parsed once and many processes can
+// share a disk safely.
+//
+// Every frame is a 32 bit length of what follows, then a 32 bit request
+// id. A request carries an op byte and its arguments; a reply carries
+// the Filesys return value and any data. Integers go in host byte
+// order, strings and blocks as a 32 bit length then the bytes. Replies
+// come back in request order.
+//
+// A client may send many requests before reading any replies. The
+// server runs each burst of requests, then commits once for all the
+// changes in it, and replies to all of them after that commit. Bursts
+// from several clients that arrive while a commit is being written
+// share the next one. A reply therefore means the change is on disk.
+enum Fsop
+{
+   NEWFILE = 1,   // name
+   RMFILE,        // name
+   GETFIRSTBLOCK, // name
+   ADDBLOCK,      // name, block
+   DELBLOCK,      // name, blocknumber
+   READBLOCK,     // name, blocknumber; reply has the block
+   WRITEBLOCK,    // name, blocknumber, block
+   NEXTBLOCK,     // name, blocknumber
+   LS,            // reply has the number of names, then each name
+   SYNC           // commits now
+};
+
+class Message // a frame being built or taken apart, without its length
+{
+   public:
+      Message();
+      void putint(int n);
+      void putstring(string_view s);
+      bool getint(int& n);
+      bool getstring(string& s);
+      string data;
+      size_t at;              // read position in data
+};
+
+class Server
+{
+   public:
+      Server(Filesys& fsys, string socketpath);
+      ~Server();
+      int run();              // serves clients until stop; 0 if the socket cannot be opened
+      void stop();            // safe from a signal handler
+   private:
+      void serve(int client); // one connection, on a thread of its own
+      bool execute(Message& request, Message& reply); // true if it changed the disk
+      void commit();          // returns once a commit after every change so far is on disk
+      Filesys& fsys;
+      string socketpath;
+      int listener;
+      atomic<bool> stopping;
+      mutex clientlock;       // clients, active
+      vector<int> clients;    // open connections
+      int active;             // connection threads still running
+      condition_variable idle; // active reached 0
+      mutex commitlock;       // requested, done, committing
+      condition_variable committed;
+      long long requested;    // commits asked for
+      long long done;         // commits asked for that are on disk
+      bool committing;        // a thread is writing a commit for the others
+};
+
+class Client
+{
+   public:
+      Client(string socketpath);
+      ~Client();
+      bool connected();
+      int newfile(string file);
+      int rmfile(string file);
+      int getfirstblock(string file);
+      int addblock(string file, string_view block);
+      int addblocks(string file, const vector<string_view>& blocks); // pipelined, a commit per window
+      int delblock(string file, int blocknumber);
+      int readblock(string file, int blocknumber, string& buffer); // appends the block to buffer
+      int writeblock(string file, int blocknumber, string_view block);
+      int nextblock(string file, int blocknumber);
+      vector<string> ls();
+      int fssynch();
+   private:
+      int send(int op, Message& request); // returns the request id, -1 if the server is gone
+      int receive(Message& reply);        // reads the next reply, returns its status
+      int call(int op, Message& request, Message& reply);
+      int fd;
+      unsigned int nextid;
+      static const int window = 256; // requests addblocks sends before reading their replies
+};
@@ -0,0 +1,33 @@
+// Serves a disk to local clients until interrupted:
+//    ./FSD diskname numberofblocks blocksize socketpath
+
+#include "sdisk.h"
+#include "filesys.h"
+#include "server.h"
+#include <cstdlib>
+#include <csignal>
+
+static Server* server = NULL;
+
+static void interrupted(int)
+{
+   if(server != NULL)
+   {
+      server->stop();
+   }
+}
+
+int main(int argc, char* argv[])
+{
+   if(argc < 5)
+   {
+      cout << "usage: " << argv[0] << " diskname numberofblocks blocksize socketpath" << endl;
+      return 1;
+   }
+   Filesys fsys(argv[1], atoi(argv[2]), atoi(argv[3]));
+   Server fsd(fsys, argv[4]);
+   server = &fsd;
+   signal(SIGINT, interrupted);
+   signal(SIGTERM, interrupted);
+   return fsd.run() == 1 ? 0 : 1;
+}
@@ -2,7 +2,15 @@
 #include "sdisk.h"
 #include "filesys.h"
 #include "shell.h"
-#include "block.cpp"
+#include "defrag.h"
+#include <thread>
+#include <cstdlib>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 Shell::Shell(string diskname, int numberofblocks, int blocksize): Filesys(diskname,numberofblocks,blocksize)
 {
@@ -37,22 +45,25 @@ int Shell::add(string file)// add a new file using input from the keyboard
    } 
    else
    {
-      newfile(file);
       cout << "Enter Contents of File: " << endl;
       string buffer;
-      char x; 
-      while(x != '~')
+      char x = 0;
+      while(x != '~' && cin.get(x))
       {
-         cin.get(x);
          buffer += x;
       }
-      vector<string> blocks = block(buffer, blocksize);
-      for(int i = 0; i < blocks.size(); i++)
-      {
-         addblock(file, blocks[i]);
-      }   
-      return 1;   
+      return addcontent(file, buffer);
+   }
+}
+int Shell::addcontent(string file, string buffer)//creates file holding buffer
+{
+   if(newfile(file) < 0)
+   {
+      return 0;
    }
+   vector<string_view> blocks = blockviews(buffer, blocksize);
+   addblocks(file, blocks); //one write batch, one sync
+   return 1;
 }
 int Shell::del(string file)// deletes the file
 {
@@ -68,12 +79,14 @@ int Shell::del(string file)// deletes the file
    }
    else
    {
+      startbatch(); //one sync for the whole chain
       while(firstblock != 0)
       {
          delblock(file,firstblock);
          firstblock = getfirstblock(file);
       }
       rmfile(file);
+      endbatch();
    }
    return 1;
 }
@@ -92,15 +105,13 @@ int Shell::type(string file)//lists the contents of file
    }
    else // there is data on the file
    {
-      string content;
-      while(block != 0)
-      {   
-         string buffer;
-         readblock(file, block, buffer); //read block to buffer
-         content += buffer; //add buffer to string
-         block = nextblock(file, block); // go to next block 
+      Fileview content; //the whole file at once, mapped or gathered
+      if(mapfile(file, content) == 0)
+      {
+         return 0;
       }
-      cout << content.substr(0,content.find('~')) << endl; //cout content
+      string_view text = content.view();
+      cout << text.substr(0,text.find('~')) << endl; //cout content
       return 1;
    }
 }
@@ -117,14 +128,464 @@ int Shell::copy(string file1, string file2)//copies file1 to file2
       cout << file2 << " already exists" << endl;
       return 0; 
    }
-   newfile(file2);
-   while(block != 0)
+   if(newfile(file2) < 0)
    {
-      string buffer;
-      readblock(file1, block, buffer); //read block into buffer
-      addblock(file2, buffer); //add block containing buffer
-      block = nextblock(file1, block); //move to next block
+      return 0;
    }
+   startbatch(); //metadata goes out once, at the end
+   vector<string> buffers; //reused, so blocks land in the same memory each run
+   while(block > 0)
+   {
+      block = readblocks(file1, block, 64, buffers); //read a run of blocks
+      if(block < 0 || addblocks(file2, buffers) < (int)buffers.size())
+      {
+         endbatch();
+         return 0;
+      }
+   }
+   endbatch();
    return 1;  
 }
-
+int Shell::copyall(string pattern, string target)//copies every file matching pattern, '*' in target becomes the source name
+{
+   vector<string> files = ls();
+   vector<string> sources;
+   vector<string> targets;
+   size_t star = target.find('*');
+   for(int i = 0; i < files.size(); i++)
+   {
+      if(files[i] != "xxxxx" && fnmatch(pattern.c_str(), files[i].c_str(), 0) == 0)
+      {
+         sources.push_back(files[i]);
+         if(star == string::npos)
+         {
+            targets.push_back(target);
+         }
+         else
+         {
+            targets.push_back(target.substr(0, star) + files[i] + target.substr(star + 1));
+         }
+      }
+   }
+   if(sources.size() == 0)
+   {
+      cout << pattern << " matches no files" << endl;
+      return 0;
+   }
+   if(sources.size() > 1 && star == string::npos)
+   {
+      cout << target << " must contain '*' to copy several files" << endl;
+      return 0;
+   }
+   startbatch();
+   int copied = runjobs(sources.size(), [&](int i) { return copy(sources[i], targets[i]); });
+   endbatch();
+   return copied;
+}
+int Shell::importdir(string hostdir)//imports every regular file of a host directory
+{
+   DIR* dir = opendir(hostdir.c_str());
+   if(dir == NULL)
+   {
+      cout << hostdir << " cannot be opened" << endl;
+      return 0;
+   }
+   vector<string> paths;
+   vector<string> files;
+   struct dirent* entry;
+   while((entry = readdir(dir)) != NULL)
+   {
+      string path = hostdir + "/" + entry->d_name;
+      struct stat st;
+      if(stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+      {
+         paths.push_back(path);
+         files.push_back(entry->d_name);
+      }
+   }
+   closedir(dir);
+   startbatch();
+   int imported = runjobs(paths.size(), [&](int i) { return importfile(paths[i], files[i]); });
+   endbatch();
+   return imported;
+}
+int Shell::runjobs(int count, function<int(int)> job)//runs job(0..count-1) on a worker pool
+{
+   int workers = thread::hardware_concurrency();
+   if(workers > count)
+   {
+      workers = count;
+   }
+   if(workers < 1)
+   {
+      workers = 1;
+   }
+   atomic<int> next(0);
+   atomic<int> done(0);
+   vector<thread> pool;
+   for(int w = 0; w < workers; w++)
+   {
+      pool.push_back(thread([&]()
+      {
+         for(int i = next++; i < count; i = next++)
+         {
+            if(job(i) > 0)
+            {
+               done++;
+            }
+         }
+      }));
+   }
+   for(int w = 0; w < pool.size(); w++)
+   {
+      pool[w].join();
+   }
+   return done;
+}
+int Shell::importfile(string hostpath, string file)//copies a host file into a new file
+{
+   int fd = open(hostpath.c_str(), O_RDONLY);
+   struct stat st;
+   if(fd < 0 || fstat(fd, &st) != 0)
+   {
+      cout << hostpath << " cannot be opened" << endl;
+      if(fd >= 0)
+      {
+         close(fd);
+      }
+      return 0;
+   }
+   //map the host file and hand the disk 1 MB runs of blocks at a time
+   size_t size = st.st_size;
+   const char* data = NULL;
+   if(size > 0)
+   {
+      void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(map == MAP_FAILED)
+      {
+         cout << hostpath << " cannot be mapped" << endl;
+         close(fd);
+         return 0;
+      }
+      madvise(map, size, MADV_SEQUENTIAL);
+      data = (const char*)map;
+   }
+   close(fd);
+   if(newfile(file) < 0)
+   {
+      if(data != NULL)
+      {
+         munmap((void*)data, size);
+      }
+      return 0;
+   }
+   int runblocks = (1 << 20) / blocksize;
+   if(runblocks < 1)
+   {
+      runblocks = 1;
+   }
+   //full blocks are views into the map; only a short last block is
+   //copied, since its '~' must share the block ahead of the padding
+   vector<string_view> views = blockviews(string_view(data == NULL ? "" : data, size), blocksize);
+   string tail;
+   if(views.back().length() < blocksize)
+   {
+      tail = string(views.back()) + '~';
+      views.back() = tail;
+   }
+   else
+   {
+      views.push_back("~");
+   }
+   int result = 1;
+   startbatch();
+   for(size_t first = 0; first < views.size() && result == 1; first += runblocks)
+   {
+      size_t last = first + runblocks < views.size() ? first + runblocks : views.size();
+      vector<string_view> blocks(views.begin() + first, views.begin() + last);
+      if(addblocks(file, blocks) < (int)blocks.size())
+      {
+         result = 0;
+      }
+   }
+   endbatch();
+   if(data != NULL)
+   {
+      munmap((void*)data, size);
+   }
+   return result;
+}
+int Shell::exportfile(string file, string hostpath)//writes a file's contents to a host file
+{
+   int block = getfirstblock(file);
+   if(block == -1)
+   {
+      cout << file << " does not exist" << endl;
+      return 0;
+   }
+   ofstream outfile(hostpath.c_str(), ios::out | ios::binary | ios::trunc);
+   if(!outfile.good())
+   {
+      cout << hostpath << " cannot be opened" << endl;
+      return 0;
+   }
+   int runblocks = (1 << 20) / blocksize;
+   if(runblocks < 1)
+   {
+      runblocks = 1;
+   }
+   string run;
+   while(block > 0)
+   {
+      vector<string> buffers;
+      block = readblocks(file, block, runblocks, buffers);
+      if(block < 0)
+      {
+         return 0;
+      }
+      run.clear();
+      for(int i = 0; i < buffers.size(); i++)
+      {
+         run += buffers[i];
+      }
+      if(block == 0 && run.size() > 0)
+      {
+         //content stops at the '~' in the last block; the rest is padding
+         size_t end = run.rfind('~');
+         if(end != string::npos && end + blocksize >= run.size())
+         {
+            run.resize(end);
+         }
+      }
+      outfile.write(run.data(), run.size());
+   }
+   return outfile.good() ? 1 : 0;
+}
+int Shell::run(istream& script)//runs a script of commands without prompts
+{
+   //Consecutive commands that touch different files form a wave and run
+   //together on the worker pool. dir, type, sync and the glob commands
+   //run alone so their output and effects keep script order. Metadata is
+   //written once at the end, or whenever the script says sync.
+   int count = 0;
+   startbatch();
+   Command command;
+   bool more = nextcommand(script, command);
+   while(more)
+   {
+      vector<Command> wave;
+      vector<string> busy;
+      while(more)
+      {
+         vector<string> names = touches(command);
+         bool alone = names.size() == 0;
+         bool clash = false;
+         for(int i = 0; i < names.size() && !clash; i++)
+         {
+            for(int j = 0; j < busy.size() && !clash; j++)
+            {
+               clash = names[i] == busy[j];
+            }
+         }
+         if(wave.size() > 0 && (alone || clash))
+         {
+            break; //command waits for the wave in front of it
+         }
+         wave.push_back(command);
+         busy.insert(busy.end(), names.begin(), names.end());
+         more = nextcommand(script, command);
+         if(alone)
+         {
+            break;
+         }
+      }
+      if(wave.size() == 1)
+      {
+         execute(wave[0]);
+      }
+      else
+      {
+         runjobs(wave.size(), [&](int i) { return execute(wave[i]); });
+      }
+      count += wave.size();
+   }
+   endbatch();
+   return count;
+}
+bool Shell::nextcommand(istream& script, Command& command)//parses the next script command
+{
+   string line;
+   while(getline(script, line))
+   {
+      istringstream words(line);
+      command.name.clear();
+      command.args.clear();
+      command.content.clear();
+      if(!(words >> command.name))
+      {
+         continue; //blank line
+      }
+      string word;
+      while(words >> word)
+      {
+         command.args.push_back(word);
+      }
+      if(command.name == "add")
+      {
+         //contents follow on the next lines up to '~', as typed interactively
+         char x = 0;
+         while(x != '~' && script.get(x))
+         {
+            command.content += x;
+         }
+         getline(script, line); //rest of the '~' line
+      }
+      return true;
+   }
+   return false;
+}
+int Shell::execute(const Command& command)//runs one parsed command
+{
+   const string& name = command.name;
+   const vector<string>& args = command.args;
+   if(name == "dir" && args.size() == 0)
+   {
+      return dir();
+   }
+   else if(name == "sync" && args.size() == 0)
+   {
+      return fssynch();
+   }
+   else if(name == "add" && args.size() == 1)
+   {
+      if(getfirstblock(args[0]) >= 0)
+      {
+         cout << args[0] << " already exists" << endl;
+         return 0;
+      }
+      return addcontent(args[0], command.content);
+   }
+   else if(name == "del" && args.size() == 1)
+   {
+      return del(args[0]);
+   }
+   else if(name == "type" && args.size() == 1)
+   {
+      return type(args[0]);
+   }
+   else if(name == "copy" && args.size() == 2)
+   {
+      return copy(args[0], args[1]);
+   }
+   else if(name == "cp" && args.size() == 2)
+   {
+      return copyall(args[0], args[1]);
+   }
+   else if(name == "import" && args.size() == 2)
+   {
+      return importfile(args[0], args[1]);
+   }
+   else if(name == "importdir" && args.size() == 1)
+   {
+      return importdir(args[0]);
+   }
+   else if(name == "export" && args.size() == 2)
+   {
+      return exportfile(args[0], args[1]);
+   }
+   else if(name == "trim" && args.size() == 1)
+   {
+      //trim on|off: punch freed blocks out of the host image
+      return settrim(args[0] == "on");
+   }
+   else if(name == "compress" && args.size() <= 1)
+   {
+      //compress on|off, or no argument for the ratio and codec times
+      if(args.size() == 1)
+      {
+         return setcompress(args[0] == "on");
+      }
+      cout << compressstats() << endl;
+      return 1;
+   }
+   else if(name == "inline" && args.size() == 1)
+   {
+      return setinline(atoi(args[0].c_str()));
+   }
+   else if(name == "dedup" && args.size() == 1)
+   {
+      return setdedup(args[0] == "on");
+   }
+   else if(name == "stats" && args.size() <= 1)
+   {
+      //stats [json|reset]
+      if(args.size() == 1 && args[0] == "reset")
+      {
+         resetstats();
+         return 1;
+      }
+      cout << stats(args.size() == 1 && args[0] == "json");
+      if(args.size() == 1 && args[0] == "json")
+      {
+         cout << endl;
+      }
+      return 1;
+   }
+   else if(name == "direct" && args.size() == 1)
+   {
+      //direct on|off: I/O past the host page cache
+      return setdirect(args[0] == "on");
+   }
+   else if(name == "flusher" && args.size() >= 1 && args.size() <= 2)
+   {
+      //flusher ms [changes]: sync in the background at most ms apart, 0 off
+      return setflusher(atoi(args[0].c_str()), args.size() > 1 ? atoi(args[1].c_str()) : 1024);
+   }
+   else if(name == "pin" && args.size() == 1)
+   {
+      return pin(args[0]);
+   }
+   else if(name == "unpin" && args.size() == 1)
+   {
+      return unpin(args[0]);
+   }
+   else if(name == "pinning" && args.size() >= 1 && args.size() <= 2)
+   {
+      //pinning blocks [reads]: files read that often are kept in memory while they fit, 0 off
+      return setpinning(atoi(args[0].c_str()), args.size() > 1 ? atoi(args[1].c_str()) : 64);
+   }
+   else if(name == "defrag" && args.size() <= 2)
+   {
+      //defrag [blocks per batch] [pause in ms between batches]
+      Defrag defrag(*this);
+      cout << "before: " << defrag.report() << endl;
+      int moved = defrag.run(args.size() > 0 ? atoi(args[0].c_str()) : 256,
+                             args.size() > 1 ? atoi(args[1].c_str()) : 0);
+      cout << "after:  " << defrag.report() << endl;
+      cout << moved << " blocks moved" << endl;
+      return 1;
+   }
+   cout << "Unknown command: " << name << endl;
+   return 0;
+}
+vector<string> Shell::touches(const Command& command)//names a command reads or writes
+{
+   //an empty list means the command must run on its own
+   const string& name = command.name;
+   vector<string> names;
+   if(name == "add" || name == "del" || name == "copy")
+   {
+      names = command.args;
+   }
+   else if(name == "import")
+   {
+      names.push_back(command.args.size() > 1 ? command.args[1] : "");
+      names.push_back("host:" + (command.args.size() > 0 ? command.args[0] : ""));
+   }
+   else if(name == "export")
+   {
+      names.push_back(command.args.size() > 0 ? command.args[0] : "");
+      names.push_back("host:" + (command.args.size() > 1 ? command.args[1] : ""));
+   }
+   return names;
+}
@@ -5,19 +5,37 @@
 #include <sstream>
 #include <fstream>
 #include <vector>
+#include <functional>
 
 using namespace std;
 
+struct Command // one parsed line of a script
+{
+   string name;
+   vector<string> args;
+   string content; // text up to and including '~' for add
+};
+
 class Shell: public Filesys
 {
    public:
-      Shell(string diskname, int blocksize, int numberofblocks);
+      Shell(string diskname, int numberofblocks, int blocksize);
       int dir();// lists all files
       int add(string file);// add a new file using input from the keyboard
       int del(string file);// deletes the file
       int type(string file);//lists the contents of file
       int copy(string file1, string file2);//copies file1 to file2
+      int copyall(string pattern, string target);//copies every file matching pattern, '*' in target becomes the source name
+      int importdir(string hostdir);//imports every regular file of a host directory
+      int importfile(string hostpath, string file);//copies a host file into a new file
+      int exportfile(string file, string hostpath);//writes a file's contents to a host file
+      int run(istream& script);//runs a script of commands without prompts
    private:
+      int addcontent(string file, string buffer);//creates file holding buffer
+      bool nextcommand(istream& script, Command& command);//parses the next script command
+      int execute(const Command& command);//runs one parsed command
+      vector<string> touches(const Command& command);//names a command reads or writes
+      int runjobs(int count, function<int(int)> job);//runs job(0..count-1) on a worker pool
       string diskname;
       int numberofblocks;
       int blocksize;
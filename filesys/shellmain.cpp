@@ -0,0 +1,34 @@
+// Runs Shell commands from a script file, or from standard input when no
+// script is named, without prompting:
+//    ./SHELL diskname numberofblocks blocksize [script]
+
+#include "sdisk.h"
+#include "filesys.h"
+#include "shell.h"
+#include <cstdlib>
+
+int main(int argc, char* argv[])
+{
+   if(argc < 4)
+   {
+      cout << "usage: " << argv[0] << " diskname numberofblocks blocksize [script]" << endl;
+      return 1;
+   }
+   Shell shell(argv[1], atoi(argv[2]), atoi(argv[3]));
+   if(argc > 4)
+   {
+      ifstream script(argv[4]);
+      if(!script.good())
+      {
+         cout << argv[4] << " cannot be opened" << endl;
+         return 1;
+      }
+      shell.run(script);
+   }
+   else
+   {
+      shell.run(cin);
+   }
+   shell.fsclose();
+   return 0;
+}
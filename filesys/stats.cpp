@@ -0,0 +1,178 @@
+#include "stats.h"
+#include <chrono>
+#include <sstream>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+static mutex slotlock;
+static vector<int> freeslots = {15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0};
+static int sharedslot = 0;
+
+struct Slotowner
+{
+   //a thread owns a slot until it exits; past 16 live threads they share
+   Slotowner()
+   {
+      lock_guard<mutex> sl(slotlock);
+      exclusive = !freeslots.empty();
+      if(exclusive)
+      {
+         slot = freeslots.back();
+         freeslots.pop_back();
+      }
+      else
+      {
+         slot = sharedslot++ % 16;
+      }
+   }
+   ~Slotowner()
+   {
+      if(exclusive)
+      {
+         lock_guard<mutex> sl(slotlock);
+         freeslots.push_back(slot);
+      }
+   }
+   int slot;
+   bool exclusive;
+};
+static thread_local Slotowner owner;
+
+int statslot()
+{
+   return owner.slot;
+}
+static void bump(atomic<long long>& n, long long v)
+{
+   //a slot freed by an exiting thread can be handed on while a sharing
+   //thread still adds into it, so even an owner's add is atomic; with
+   //no one else on the line it costs little more than a store
+   n.fetch_add(v, memory_order_relaxed);
+}
+Counter::Counter()
+{
+   reset();
+}
+void Counter::add(long long n)
+{
+   bump(slots[statslot()].n, n);
+}
+long long Counter::value()
+{
+   long long total = 0;
+   for(int s = 0; s < 16; s++)
+   {
+      total += slots[s].n.load(memory_order_relaxed);
+   }
+   return total;
+}
+void Counter::reset()
+{
+   for(int s = 0; s < 16; s++)
+   {
+      slots[s].n = 0;
+   }
+}
+Histogram::Histogram()
+{
+   reset();
+}
+void Histogram::add(long long ns)
+{
+   int k = ns > 0 ? 64 - __builtin_clzll(ns) : 0; //bits in ns: the first 2^k above it
+   if(k >= buckets)
+   {
+      k = buckets - 1;
+   }
+   bump(rows[statslot()].counts[k], 1);
+   nanoseconds.add(ns);
+}
+void Histogram::sum(long long* counts)
+{
+   for(int k = 0; k < buckets; k++)
+   {
+      counts[k] = 0;
+      for(int s = 0; s < 16; s++)
+      {
+         counts[k] += rows[s].counts[k].load(memory_order_relaxed);
+      }
+   }
+}
+long long Histogram::count()
+{
+   long long counts[buckets];
+   sum(counts);
+   long long n = 0;
+   for(int k = 0; k < buckets; k++)
+   {
+      n += counts[k];
+   }
+   return n;
+}
+long long Histogram::total()
+{
+   return nanoseconds.value();
+}
+long long Histogram::percentile(int p)
+{
+   long long counts[buckets];
+   sum(counts);
+   long long n = 0;
+   for(int k = 0; k < buckets; k++)
+   {
+      n += counts[k];
+   }
+   long long seen = 0;
+   for(int k = 0; k < buckets; k++)
+   {
+      seen += counts[k];
+      if(n > 0 && seen * 100 >= n * p)
+      {
+         return 1LL << k;
+      }
+   }
+   return 0;
+}
+string Histogram::json()
+{
+   long long counts[buckets];
+   sum(counts);
+   ostringstream out;
+   out << "{\"count\":" << count() << ",\"total_ns\":" << total()
+       << ",\"p50_ns\":" << percentile(50) << ",\"p99_ns\":" << percentile(99) << ",\"buckets\":[";
+   bool first = true;
+   for(int k = 0; k < buckets; k++)
+   {
+      if(counts[k] > 0)
+      {
+         out << (first ? "" : ",") << "[" << (1LL << k) << "," << counts[k] << "]";
+         first = false;
+      }
+   }
+   out << "]}";
+   return out.str();
+}
+string Histogram::text()
+{
+   long long n = count();
+   char line[128];
+   snprintf(line, sizeof(line), "%lld, mean %.1f us, p50 < %.1f us, p99 < %.1f us", n,
+            n > 0 ? total() / 1000.0 / n : 0.0, percentile(50) / 1000.0, percentile(99) / 1000.0);
+   return line;
+}
+void Histogram::reset()
+{
+   for(int s = 0; s < 16; s++)
+   {
+      for(int k = 0; k < buckets; k++)
+      {
+         rows[s].counts[k] = 0;
+      }
+   }
+   nanoseconds.reset();
+}
+long long Histogram::now()
+{
+   return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
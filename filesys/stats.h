@@ -0,0 +1,51 @@
+#include <string>
+#include <atomic>
+
+using namespace std;
+
+// Counters and latency histograms that many threads update at once with
+// no lock. Each thread adds atomically into a cache-line-sized slot of
+// its own, so adds rarely contend, and a read sums the slots. Past 16
+// live threads, slots are shared. A read taken while others are adding
+// is close, not exact.
+class Counter
+{
+   public:
+      Counter();
+      void add(long long n);
+      long long value();
+      void reset();
+   private:
+      struct alignas(64) Slot
+      {
+         atomic<long long> n;
+      };
+      Slot slots[16];
+};
+
+// Latencies in nanoseconds, bucketed by power of two: bucket k counts
+// times below 2^k ns.
+class Histogram
+{
+   public:
+      Histogram();
+      void add(long long ns);
+      long long count();
+      long long total();          // nanoseconds over all adds
+      long long percentile(int p); // upper bound of the bucket holding the p-th percentile, ns
+      string json();              // {"count":..,"total_ns":..,"p50_ns":..,"p99_ns":..,"buckets":[[below_ns,count],..]}
+      string text();              // count, mean, p50 and p99 on one line
+      void reset();
+      static long long now();     // steady clock in nanoseconds
+   private:
+      static const int buckets = 40;
+      struct alignas(64) Row
+      {
+         atomic<long long> counts[buckets];
+      };
+      void sum(long long* counts);
+      Row rows[16];
+      Counter nanoseconds;
+};
+
+int statslot(); // the slot this thread adds into
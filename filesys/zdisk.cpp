@@ -0,0 +1,693 @@
+#include "zdisk.h"
+#include "lz.h"
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+
+static long long nanos()
+{
+   return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+static unsigned long long rotate(unsigned long long x, int r)
+{
+   return (x << r) | (x >> (64 - r));
+}
+unsigned long long blockhash(const char* data, int length)
+{
+   //eight bytes per multiply and rotate, then a final mix; collisions
+   //are settled by comparing bytes, so it only has to spread well
+   const unsigned long long p1 = 0x9E3779B185EBCA87ULL;
+   const unsigned long long p2 = 0xC2B2AE3D27D4EB4FULL;
+   unsigned long long h = p2 ^ (unsigned long long)length * p1;
+   int i = 0;
+   for(; i + 8 <= length; i += 8)
+   {
+      unsigned long long k;
+      memcpy(&k, data + i, 8);
+      h ^= rotate(k * p2, 31) * p1;
+      h = rotate(h, 27) * p1 + p2;
+   }
+   for(; i < length; i++)
+   {
+      h ^= (unsigned char)data[i] * p1;
+      h = rotate(h, 11) * p2;
+   }
+   h ^= h >> 33;
+   h *= p2;
+   h ^= h >> 29;
+   return h;
+}
+
+Zdisk::Zdisk(string diskname, int numberofblocks, int blocksize)
+{
+   this->numberofblocks = numberofblocks;
+   this->blocksize = blocksize;
+   mapname = diskname + ".zmap";
+   map = vector<Zextent>(numberofblocks);
+   for(int i = 0; i < numberofblocks; i++)
+   {
+      map[i].offset = 0;
+      map[i].length = 0;
+   }
+   logsize = 0;
+   livebytes = 0;
+   generation = 0;
+   saves = 0;
+   mapsaved = false;
+   saveddedup = false;
+   mapentries = 0;
+   isdirty = vector<char>(numberofblocks, 0);
+   cachesize = 1024;
+   deduping = false;
+   logical = physical = compressns = decompressns = hits = misses = shared = 0;
+
+   //map header: zmap numberofblocks blocksize generation logsize dedup saves,
+   //then binary (block, offset, length) for every block the log decides
+   ifstream mapfile(mapname.c_str(), ios::in | ios::binary);
+   string header;
+   getline(mapfile, header);
+   istringstream fields(header);
+   string magic;
+   int n = 0;
+   int size = 0;
+   int dedup = 0;
+   if(fields >> magic >> n >> size >> generation >> logsize && magic == "zmap"
+      && n == numberofblocks && size == blocksize)
+   {
+      fields >> dedup >> saves;
+      mapsaved = true;
+      saveddedup = dedup == 1;
+      int block;
+      Zextent e;
+      while(mapfile.read((char*)&block, sizeof(block)) && mapfile.read((char*)&e.offset, sizeof(e.offset))
+            && mapfile.read((char*)&e.length, sizeof(e.length)))
+      {
+         if(block >= 0 && block < numberofblocks)
+         {
+            map[block] = e;
+            mapentries++;
+         }
+      }
+   }
+   else
+   {
+      generation = 0;
+      logsize = 0;
+   }
+   journalname = diskname + ".zjournal";
+   journalfd = open(journalname.c_str(), O_RDWR | O_CREAT, 0644);
+   replay();
+   savedlogsize = logsize;
+   for(int i = 0; i < numberofblocks; i++)
+   {
+      Zextent e = map[i];
+      if(e.length > 0 && records[e.offset].refs++ == 0)
+      {
+         records[e.offset].length = e.length; //first block mapped to this record
+         livebytes += e.length;
+      }
+   }
+   logname = diskname + ".z" + to_string(generation);
+   logfd = open(logname.c_str(), O_RDWR | O_CREAT, 0644);
+   if(logfd < 0)
+   {
+      cout << "Cannot open " << logname << endl;
+   }
+   tailstart = logsize - logsize % blocksize;
+   tail = string(logsize - tailstart, '\0');
+   if(tail.size() > 0)
+   {
+      pread(logfd, &tail[0], tail.size(), tailstart);
+   }
+   if(dedup == 1)
+   {
+      setdedup(true);
+   }
+}
+Zdisk::~Zdisk()
+{
+   if(logfd >= 0)
+   {
+      sync();
+      close(logfd);
+   }
+   if(journalfd >= 0)
+   {
+      close(journalfd);
+   }
+}
+int Zdisk::getblock(int blocknumber, char* data)
+{
+   unique_lock<mutex> zl(zlock);
+   Zextent e = map[blocknumber];
+   if(e.length == 0)
+   {
+      return 0; //never written through the log
+   }
+   if(e.length < 0)
+   {
+      memset(data, '#', blocksize);
+      return 1;
+   }
+   auto found = cache.find(blocknumber);
+   if(found != cache.end())
+   {
+      hits++;
+      memcpy(data, found->second.first.data(), blocksize);
+      lru.splice(lru.begin(), lru, found->second.second);
+      return 1;
+   }
+   misses++;
+   string record(e.length, '\0');
+   if(readlog(e.offset, e.length, &record[0]) == 0)
+   {
+      return 0;
+   }
+   zl.unlock();
+
+   long long spent = 0;
+   if(e.length == blocksize)
+   {
+      memcpy(data, record.data(), blocksize); //stored raw
+   }
+   else
+   {
+      long long start = nanos();
+      if(lzdecompress(record.data(), e.length, data, blocksize) != blocksize)
+      {
+         cout << "Block " << blocknumber << " does not decompress" << endl;
+         return 0;
+      }
+      spent = nanos() - start;
+   }
+
+   zl.lock();
+   decompressns += spent;
+   if(map[blocknumber].offset == e.offset && map[blocknumber].length == e.length
+      && cache.find(blocknumber) == cache.end())
+   {
+      remember(blocknumber, data);
+   }
+   return 1;
+}
+int Zdisk::putblock(int blocknumber, const char* data)
+{
+   unsigned long long hash = 0;
+   if(deduping)
+   {
+      hash = blockhash(data, blocksize);
+      lock_guard<mutex> zl(zlock);
+      auto range = hashes.equal_range(hash);
+      string candidate(blocksize, '\0');
+      for(auto it = range.first; it != range.second; it++)
+      {
+         long long offset = it->second;
+         Zrecord& r = records[offset];
+         if(readrecord(offset, r.length, &candidate[0]) == 1
+            && memcmp(candidate.data(), data, blocksize) == 0)
+         {
+            r.refs++; //before forget, in case this block already maps here
+            forget(blocknumber);
+            map[blocknumber].offset = offset;
+            map[blocknumber].length = r.length;
+            touch(blocknumber);
+            logical += blocksize;
+            shared++;
+            remember(blocknumber, data);
+            return 1;
+         }
+      }
+   }
+
+   long long start = nanos();
+   string record;
+   if(lzcompress(data, blocksize, record) >= blocksize)
+   {
+      record.assign(data, blocksize); //does not pay, keep it raw
+   }
+   long long spent = nanos() - start;
+
+   lock_guard<mutex> zl(zlock);
+   forget(blocknumber);
+   long long offset = append(record);
+   map[blocknumber].offset = offset;
+   map[blocknumber].length = record.size();
+   touch(blocknumber);
+   Zrecord& r = records[offset];
+   r.length = record.size();
+   r.refs = 1;
+   r.hash = 0;
+   if(deduping)
+   {
+      r.hash = hash != 0 ? hash : blockhash(data, blocksize);
+      hashes.insert(make_pair(r.hash, offset));
+   }
+   livebytes += record.size();
+   logical += blocksize;
+   physical += record.size();
+   compressns += spent;
+   remember(blocknumber, data); //a read right after costs nothing
+   return 1;
+}
+int Zdisk::drop(int blocknumber)
+{
+   lock_guard<mutex> zl(zlock);
+   forget(blocknumber);
+   map[blocknumber].offset = 0;
+   map[blocknumber].length = -1;
+   touch(blocknumber);
+   return 1;
+}
+int Zdisk::stored(int blocknumber)
+{
+   lock_guard<mutex> zl(zlock);
+   return map[blocknumber].length != 0 ? 1 : 0;
+}
+int Zdisk::sync()
+{
+   lock_guard<mutex> zl(zlock);
+   if(logsize - livebytes > livebytes && logsize > 64LL * blocksize)
+   {
+      compact();
+   }
+   if(tail.size() > 0)
+   {
+      pwrite(logfd, tail.data(), tail.size(), tailstart); //open page, rewritten as it fills
+   }
+   fdatasync(logfd);
+   return savejournal();
+}
+int Zdisk::erase()
+{
+   lock_guard<mutex> zl(zlock);
+   close(logfd);
+   logfd = -1;
+   remove(logname.c_str());
+   remove(mapname.c_str());
+   if(journalfd >= 0)
+   {
+      close(journalfd);
+      journalfd = -1;
+   }
+   remove(journalname.c_str());
+   return 1;
+}
+int Zdisk::setdedup(bool on)
+{
+   lock_guard<mutex> zl(zlock);
+   if(on && !deduping)
+   {
+      for(auto it = records.begin(); it != records.end(); it++)
+      {
+         index(it->first); //what is already stored can be shared too
+      }
+   }
+   else if(!on)
+   {
+      hashes.clear();
+   }
+   deduping = on;
+   return 1;
+}
+string Zdisk::stats()
+{
+   lock_guard<mutex> zl(zlock);
+   long long blocks = 0;
+   for(int i = 0; i < numberofblocks; i++)
+   {
+      if(map[i].length > 0)
+      {
+         blocks++;
+      }
+   }
+   ostringstream out;
+   out.precision(2);
+   out << fixed << blocks << " blocks in " << livebytes << " bytes of a " << logsize << " byte log";
+   if(livebytes > 0)
+   {
+      out << ", ratio " << (double)(blocks * blocksize) / livebytes << ":1";
+   }
+   if(logical > 0)
+   {
+      out << ", this mount " << (double)logical / physical << ":1 over " << logical / blocksize << " writes"
+          << ", compress " << (double)compressns / (logical / blocksize) / 1000 << " us/block";
+   }
+   if(misses > 0)
+   {
+      out << ", decompress " << (double)decompressns / misses / 1000 << " us/block";
+   }
+   out << ", cache " << hits << " hits " << misses << " misses";
+   if(records.size() > 0 && records.size() < blocks)
+   {
+      out << ", dedup " << blocks << " blocks on " << records.size() << " records "
+          << (double)blocks / records.size() << ":1";
+   }
+   if(deduping)
+   {
+      //nodes hold the key, value and a next pointer; buckets are one pointer each
+      long long bytes = hashes.size() * (sizeof(pair<unsigned long long, long long>) + sizeof(void*))
+                      + hashes.bucket_count() * sizeof(void*)
+                      + records.size() * (sizeof(pair<long long, Zrecord>) + sizeof(void*))
+                      + records.bucket_count() * sizeof(void*);
+      out << ", dedup on, " << shared << " writes shared, index " << hashes.size()
+          << " hashes in about " << (bytes + 1023) / 1024 << " KB";
+   }
+   return out.str();
+}
+int Zdisk::readlog(long long offset, int length, char* data)
+{
+   //the part below the open page is in the file, the rest in tail
+   int done = 0;
+   if(offset < tailstart)
+   {
+      int part = tailstart - offset < length ? tailstart - offset : length;
+      if(pread(logfd, data, part, offset) != part)
+      {
+         return 0;
+      }
+      done = part;
+   }
+   if(done < length)
+   {
+      memcpy(data + done, tail.data() + (offset + done - tailstart), length - done);
+   }
+   return 1;
+}
+int Zdisk::readrecord(long long offset, int length, char* data)
+{
+   if(length == blocksize)
+   {
+      return readlog(offset, length, data); //stored raw
+   }
+   string record(length, '\0');
+   if(readlog(offset, length, &record[0]) == 0)
+   {
+      return 0;
+   }
+   return lzdecompress(record.data(), length, data, blocksize) == blocksize ? 1 : 0;
+}
+void Zdisk::index(long long offset)
+{
+   Zrecord& r = records[offset];
+   string data(blocksize, '\0');
+   if(readrecord(offset, r.length, &data[0]) == 1)
+   {
+      r.hash = blockhash(data.data(), blocksize);
+      hashes.insert(make_pair(r.hash, offset));
+   }
+}
+void Zdisk::unindex(long long offset)
+{
+   auto range = hashes.equal_range(records[offset].hash);
+   for(auto it = range.first; it != range.second; it++)
+   {
+      if(it->second == offset)
+      {
+         hashes.erase(it);
+         return;
+      }
+   }
+}
+long long Zdisk::append(const string& record)
+{
+   long long offset = logsize;
+   tail += record;
+   logsize += record.size();
+   while(tail.size() >= blocksize)
+   {
+      pwrite(logfd, tail.data(), blocksize, tailstart); //a full physical block
+      tail.erase(0, blocksize);
+      tailstart += blocksize;
+   }
+   return offset;
+}
+void Zdisk::forget(int blocknumber)
+{
+   if(map[blocknumber].length > 0)
+   {
+      auto r = records.find(map[blocknumber].offset);
+      if(r != records.end() && --r->second.refs == 0)
+      {
+         livebytes -= r->second.length; //last block on this record
+         if(deduping)
+         {
+            unindex(r->first);
+         }
+         records.erase(r);
+      }
+   }
+   auto found = cache.find(blocknumber);
+   if(found != cache.end())
+   {
+      lru.erase(found->second.second);
+      cache.erase(found);
+   }
+}
+void Zdisk::remember(int blocknumber, const char* data)
+{
+   lru.push_front(blocknumber);
+   cache[blocknumber] = make_pair(string(data, blocksize), lru.begin());
+   if(cache.size() > cachesize)
+   {
+      cache.erase(lru.back());
+      lru.pop_back();
+   }
+}
+void Zdisk::compact()
+{
+   //copy the live records into the next generation of the log; the map
+   //that names the new log is the commit, then the old log goes
+   string newname = mapname.substr(0, mapname.size() - 5) + ".z" + to_string(generation + 1);
+   int newfd = open(newname.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if(newfd < 0)
+   {
+      return;
+   }
+   vector<Zextent> newmap = map;
+   unordered_map<long long, long long> moved; //old offset to new, so shared records stay shared
+   string pages;
+   long long written = 0;
+   for(int i = 0; i < numberofblocks; i++)
+   {
+      if(map[i].length <= 0)
+      {
+         continue;
+      }
+      auto done = moved.find(map[i].offset);
+      if(done != moved.end())
+      {
+         newmap[i].offset = done->second;
+         continue;
+      }
+      moved[map[i].offset] = written + pages.size();
+      string record(map[i].length, '\0');
+      readlog(map[i].offset, map[i].length, &record[0]);
+      newmap[i].offset = written + pages.size();
+      pages += record;
+      if(pages.size() >= 256 * blocksize)
+      {
+         int full = pages.size() - pages.size() % blocksize;
+         pwrite(newfd, pages.data(), full, written);
+         written += full;
+         pages.erase(0, full);
+      }
+   }
+   pwrite(newfd, pages.data(), pages.size(), written);
+   fdatasync(newfd);
+   string oldname = logname;
+   int oldfd = logfd;
+   map = newmap;
+   unordered_map<long long, Zrecord> newrecords;
+   for(auto it = records.begin(); it != records.end(); it++)
+   {
+      newrecords[moved[it->first]] = it->second;
+   }
+   records.swap(newrecords);
+   for(auto it = hashes.begin(); it != hashes.end(); it++)
+   {
+      it->second = moved[it->second];
+   }
+   logname = newname;
+   logfd = newfd;
+   generation++;
+   logsize = written + pages.size();
+   tailstart = logsize - logsize % blocksize;
+   tail = pages.substr(pages.size() - (logsize - tailstart));
+   if(savemap() == 1)
+   {
+      close(oldfd);
+      remove(oldname.c_str());
+   }
+}
+int Zdisk::savemap()
+{
+   //the whole map under the next save number, so batches journaled
+   //against the last one are stale even if the journal is not cut yet
+   string tmpname = mapname + ".tmp";
+   ofstream mapfile(tmpname.c_str(), ios::out | ios::binary | ios::trunc);
+   mapfile << "zmap " << numberofblocks << " " << blocksize << " " << generation << " " << logsize << " "
+           << (deduping ? 1 : 0) << " " << saves + 1 << "\n";
+   long long entries = 0;
+   for(int i = 0; i < numberofblocks; i++)
+   {
+      if(map[i].length != 0)
+      {
+         mapfile.write((const char*)&i, sizeof(i));
+         mapfile.write((const char*)&map[i].offset, sizeof(map[i].offset));
+         mapfile.write((const char*)&map[i].length, sizeof(map[i].length));
+         entries++;
+      }
+   }
+   mapfile.close();
+   if(!mapfile.good())
+   {
+      return 0;
+   }
+   int fd = open(tmpname.c_str(), O_RDONLY);
+   if(fd >= 0)
+   {
+      fdatasync(fd);
+      close(fd);
+   }
+   if(rename(tmpname.c_str(), mapname.c_str()) != 0)
+   {
+      return 0;
+   }
+   saves++;
+   mapsaved = true;
+   saveddedup = deduping;
+   mapentries = entries;
+   savedlogsize = logsize;
+   for(int i = 0; i < dirty.size(); i++)
+   {
+      isdirty[dirty[i]] = 0;
+   }
+   dirty.clear();
+   if(journalfd >= 0)
+   {
+      ftruncate(journalfd, 0);
+   }
+   journalsize = 0;
+   journalentries = 0;
+   return 1;
+}
+int Zdisk::savejournal()
+{
+   //a batch is the changed extents, then a marker with the log size, the
+   //save it follows and a hash of the batch; the whole map goes out
+   //instead once the journal would outgrow it, or when only the header
+   //can say dedup changed
+   if(!mapsaved || journalfd < 0 || deduping != saveddedup
+      || journalentries + dirty.size() > max(mapentries, 4096LL))
+   {
+      return savemap();
+   }
+   if(dirty.empty() && logsize == savedlogsize)
+   {
+      return 1;
+   }
+   string batch;
+   for(int i = 0; i < dirty.size(); i++)
+   {
+      int block = dirty[i];
+      batch.append((const char*)&block, sizeof(block));
+      batch.append((const char*)&map[block].offset, sizeof(map[block].offset));
+      batch.append((const char*)&map[block].length, sizeof(map[block].length));
+   }
+   unsigned long long hash = blockhash(batch.data(), batch.size());
+   int marker = -1;
+   batch.append((const char*)&marker, sizeof(marker));
+   batch.append((const char*)&logsize, sizeof(logsize));
+   batch.append((const char*)&saves, sizeof(saves));
+   batch.append((const char*)&hash, sizeof(hash));
+   if(pwrite(journalfd, batch.data(), batch.size(), journalsize) != (ssize_t)batch.size() || fdatasync(journalfd) != 0)
+   {
+      return 0;
+   }
+   journalsize += batch.size();
+   journalentries += dirty.size();
+   savedlogsize = logsize;
+   for(int i = 0; i < dirty.size(); i++)
+   {
+      isdirty[dirty[i]] = 0;
+   }
+   dirty.clear();
+   return 1;
+}
+void Zdisk::replay()
+{
+   //applies every whole batch that follows the saved map; a torn or
+   //stale batch ends the journal
+   journalsize = 0;
+   journalentries = 0;
+   string journal;
+   char buffer[65536];
+   ssize_t n;
+   while(journalfd >= 0 && (n = pread(journalfd, buffer, sizeof(buffer), journal.size())) > 0)
+   {
+      journal.append(buffer, n);
+   }
+   const int entry = sizeof(int) + sizeof(long long) + sizeof(int);
+   const int mark = sizeof(int) + sizeof(long long) + sizeof(int) + sizeof(unsigned long long);
+   size_t start = 0;
+   size_t at = 0;
+   while(mapsaved && at + sizeof(int) <= journal.size())
+   {
+      int block;
+      memcpy(&block, journal.data() + at, sizeof(block));
+      if(block != -1)
+      {
+         if(block < 0 || block >= numberofblocks || at + entry > journal.size())
+         {
+            break;
+         }
+         at += entry;
+         continue;
+      }
+      if(at + mark > journal.size())
+      {
+         break;
+      }
+      long long size;
+      int save;
+      unsigned long long hash;
+      memcpy(&size, journal.data() + at + sizeof(int), sizeof(size));
+      memcpy(&save, journal.data() + at + sizeof(int) + sizeof(size), sizeof(save));
+      memcpy(&hash, journal.data() + at + sizeof(int) + sizeof(size) + sizeof(save), sizeof(hash));
+      if(save != saves || hash != blockhash(journal.data() + start, at - start))
+      {
+         break;
+      }
+      for(size_t p = start; p < at; p += entry)
+      {
+         Zextent e;
+         memcpy(&block, journal.data() + p, sizeof(block));
+         memcpy(&e.offset, journal.data() + p + sizeof(int), sizeof(e.offset));
+         memcpy(&e.length, journal.data() + p + sizeof(int) + sizeof(e.offset), sizeof(e.length));
+         map[block] = e;
+         journalentries++;
+      }
+      logsize = size;
+      at += mark;
+      start = at;
+      journalsize = at;
+   }
+   if(journalfd >= 0 && journalsize < journal.size())
+   {
+      ftruncate(journalfd, journalsize); //the next batch goes where the good ones end
+   }
+}
+void Zdisk::touch(int blocknumber)
+{
+   if(!isdirty[blocknumber])
+   {
+      isdirty[blocknumber] = 1;
+      dirty.push_back(blocknumber);
+   }
+}
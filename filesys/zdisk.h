@@ -0,0 +1,97 @@
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+
+using namespace std;
+
+unsigned long long blockhash(const char* data, int length); // fast hash for dedup and mirror checksums
+
+// Compressed block store that an Sdisk hands its blocks to once
+// compression is on. Each block is LZ compressed (or kept raw when that
+// does not pay) and appended to a log, diskname.z, that is written out a
+// whole physical block at a time, so several small blocks share one
+// physical block. diskname.zmap says where each logical block lives, and
+// diskname.zjournal holds the entries changed since it was written, so a
+// sync writes only those; the map is rewritten once the journal grows as
+// long as it, and at every compaction.
+// Blocks the log does not hold are still read from the plain image.
+// Recently read blocks are kept decompressed in an LRU cache, and the log
+// is compacted at sync once more than half of it is dead. With dedup on, a
+// block whose contents are already in the log is mapped to that record
+// instead of being written again; records count the blocks mapped to them.
+class Zdisk
+{
+   public:
+      Zdisk(string diskname, int numberofblocks, int blocksize);
+      ~Zdisk();
+      int getblock(int blocknumber, char* data); // 1 if served here, 0 to read the plain image
+      int putblock(int blocknumber, const char* data);
+      int drop(int blocknumber);  // freed: reads back as '#' fill
+      int sync();                 // open page and map to disk, compacting if worthwhile
+      int stored(int blocknumber); // 1 if the log or a drop decides this block's contents
+      int erase();                // closes and removes the log and map
+      int setdedup(bool on);      // indexes the log by content when turned on
+      string stats();
+   private:
+      struct Zextent
+      {
+         long long offset;   // byte position in the log
+         int length;         // compressed bytes, blocksize for raw, 0 not here, -1 dropped
+      };
+      struct Zrecord
+      {
+         int length;               // bytes in the log
+         int refs;                 // blocks mapped to this record
+         unsigned long long hash;  // content hash, set while dedup is on
+      };
+      int readlog(long long offset, int length, char* data); // caller holds zlock
+      int readrecord(long long offset, int length, char* data); // decompressed, caller holds zlock
+      void index(long long offset);            // caller holds zlock
+      void unindex(long long offset);          // caller holds zlock
+      long long append(const string& record);  // caller holds zlock
+      void forget(int blocknumber);            // caller holds zlock
+      void remember(int blocknumber, const char* data); // caller holds zlock
+      void compact();                          // caller holds zlock
+      int savemap();                           // the whole map, emptying the journal; caller holds zlock
+      int savejournal();                       // changed entries, or the whole map; caller holds zlock
+      void replay();                           // applies the journal to a loaded map
+      void touch(int blocknumber);             // map entry changed; caller holds zlock
+      string logname;
+      string mapname;
+      int numberofblocks;
+      int blocksize;
+      int logfd;
+      int generation;         // log file suffix, bumped by every compaction
+      vector<Zextent> map;
+      string journalname;
+      int journalfd;
+      long long journalsize;  // bytes of whole batches in the journal
+      long long journalentries; // entries in those batches
+      long long mapentries;   // entries in the map when it was saved
+      long long savedlogsize; // log size the map and journal record
+      int saves;              // whole map writes; a batch names the one it follows
+      bool mapsaved;          // a map is on disk for the journal to follow
+      bool saveddedup;        // dedup flag in the map header on disk
+      vector<int> dirty;      // blocks whose entry changed since the last save
+      vector<char> isdirty;
+      unordered_map<long long, Zrecord> records;          // live records by log offset
+      unordered_multimap<unsigned long long, long long> hashes; // content hash to log offset
+      bool deduping;
+      long long logsize;      // bytes in the log, open page included
+      long long tailstart;    // log offset of the open page
+      string tail;            // open page, not yet full
+      long long livebytes;    // bytes of the log still mapped
+      list<int> lru;          // cached blocks, most recent first
+      unordered_map<int, pair<string, list<int>::iterator> > cache;
+      int cachesize;          // blocks kept decompressed
+      mutex zlock;
+      long long logical;      // bytes handed to putblock
+      long long physical;     // bytes those became in the log
+      long long compressns;   // time spent compressing
+      long long decompressns; // time spent decompressing
+      long long hits;
+      long long misses;
+      long long shared;       // writes that found their contents already stored
+};